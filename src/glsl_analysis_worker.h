@@ -0,0 +1,158 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Worker thread which analyses sources in the background for glsl_include.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace mkr {
+/**
+ * Runs jobs on a worker thread, in the order they were pushed. Each job is keyed by the object it writes to.
+ * Before reading or changing that object, call await() or cancel() with its key,
+ * so the object is never touched by both threads at once.
+ */
+class analysis_worker {
+ private:
+    struct job {
+        const void *key_;
+        std::function<void()> run_;
+    };
+
+    std::list<job> queue_;
+    std::unordered_map<const void *, std::list<job>::iterator> index_;
+    const void *running_ = nullptr;
+    std::atomic<size_t> pending_ = 0; // Queued and running jobs.
+    std::mutex mutex_;
+    std::condition_variable queued_cv_;
+    std::condition_variable done_cv_;
+    bool stop_ = false;
+    std::thread worker_;
+
+    void run() {
+        std::unique_lock lock{mutex_};
+        while (true) {
+            queued_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+            if (stop_) { return; }
+
+            job next = std::move(queue_.front());
+            queue_.pop_front();
+            index_.erase(next.key_);
+            running_ = next.key_;
+            lock.unlock();
+            next.run_();
+            lock.lock();
+            running_ = nullptr;
+            pending_.fetch_sub(1, std::memory_order_release);
+            done_cv_.notify_all();
+        }
+    }
+
+    // Take a queued job out of the queue. Returns an empty function if it is not queued.
+    std::function<void()> take(const void *_key) {
+        auto iter = index_.find(_key);
+        if (iter == index_.end()) { return {}; }
+        std::function<void()> out = std::move(iter->second->run_);
+        queue_.erase(iter->second);
+        index_.erase(iter);
+        return out;
+    }
+
+ public:
+    analysis_worker() {
+        worker_ = std::thread([this] { run(); });
+    }
+
+    /**
+     * Wait for the running job to finish, then stop. Queued jobs are dropped.
+     */
+    ~analysis_worker() {
+        {
+            std::lock_guard lock{mutex_};
+            stop_ = true;
+        }
+        queued_cv_.notify_one();
+        worker_.join();
+    }
+
+    analysis_worker(const analysis_worker &) = delete;
+
+    analysis_worker &operator=(const analysis_worker &) = delete;
+
+    /**
+     * Queue a job. There must not already be a queued or running job with the same key.
+     */
+    void push(const void *_key, std::function<void()> _run) {
+        {
+            std::lock_guard lock{mutex_};
+            queue_.push_back(job{_key, std::move(_run)});
+            index_.emplace(_key, std::prev(queue_.end()));
+            pending_.fetch_add(1, std::memory_order_relaxed);
+        }
+        queued_cv_.notify_one();
+    }
+
+    /**
+     * Make sure the job with a key has finished. A queued job is run on the calling thread instead of waiting for its turn.
+     */
+    void await(const void *_key) {
+        if (pending_.load(std::memory_order_acquire) == 0) { return; }
+        std::unique_lock lock{mutex_};
+        if (auto run = take(_key)) {
+            lock.unlock();
+            run();
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+        done_cv_.wait(lock, [this, _key] { return running_ != _key; });
+    }
+
+    /**
+     * Make sure the job with a key will not run. A queued job is dropped, and a running job is waited for.
+     */
+    void cancel(const void *_key) {
+        if (pending_.load(std::memory_order_acquire) == 0) { return; }
+        std::unique_lock lock{mutex_};
+        if (take(_key)) {
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+        done_cv_.wait(lock, [this, _key] { return running_ != _key; });
+    }
+
+    /**
+     * Make sure every job has finished. Queued jobs are run on the calling thread.
+     */
+    void await_all() {
+        if (pending_.load(std::memory_order_acquire) == 0) { return; }
+        std::unique_lock lock{mutex_};
+        std::list<job> queued = std::move(queue_);
+        queue_.clear();
+        index_.clear();
+        lock.unlock();
+        for (job &next : queued) {
+            next.run_();
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        lock.lock();
+        done_cv_.wait(lock, [this] { return running_ == nullptr; });
+    }
+
+    /**
+     * Drop every queued job, and wait for the running job.
+     */
+    void cancel_all() {
+        std::unique_lock lock{mutex_};
+        pending_.fetch_sub(queue_.size(), std::memory_order_relaxed);
+        queue_.clear();
+        index_.clear();
+        done_cv_.wait(lock, [this] { return running_ == nullptr; });
+    }
+};
+}
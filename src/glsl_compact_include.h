@@ -0,0 +1,264 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Compact storage for libraries of millions of small sources.
+// See README.md for usage example.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "glsl_directive.h"
+#include "glsl_memory.h"
+
+namespace mkr {
+/**
+ * Merges sources with the same rules as glsl_include, but stores them with a small, fixed overhead per source.
+ * Names and texts are pooled in two buffers, each source is a handful of 32-bit offsets, names are found through an
+ * open-addressed table of source IDs, and includes are one array of source IDs.
+ * Nothing is cached per source: directives are parsed again whenever a source is merged, which is cheap for small sources.
+ * The overhead is under 64 bytes per source, on top of its name and text, once the includes are resolved.
+ */
+class glsl_compact_include {
+ private:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    // Names are pooled in the order that sources were added. The name of source i is [name_begin_[i], name_begin_[i + 1]).
+    std::string names_;
+    std::vector<uint32_t> name_begin_{0};
+
+    // Texts are pooled in the order that they were added. A replaced text stays in the pool.
+    std::string texts_;
+    std::vector<uint32_t> text_begin_;
+    std::vector<uint32_t> text_size_;
+
+    std::vector<uint32_t> table_; // Source IDs by hash of their name, probed linearly. npos marks an empty slot.
+
+    // The source included by each directive of each source. The includes of source i are edges_[first_edge_[i], first_edge_[i + 1]).
+    // They are resolved on the first merge after sources are added.
+    std::vector<uint32_t> first_edge_;
+    std::vector<uint32_t> edges_;
+    bool resolved_ = false;
+
+    // The merge which last emitted each source, and whether each source is being expanded.
+    std::vector<uint32_t> emitted_;
+    std::vector<bool> on_path_;
+    uint32_t epoch_ = 0;
+
+    // A source being expanded. Sources are expanded with an explicit stack, so deep chains of includes cannot overflow the call stack.
+    struct frame {
+        uint32_t src_ = 0;
+        uint32_t edge_ = 0; // The next include.
+        uint32_t pos_ = 0; // The next byte of the text to copy.
+        uint32_t line_ = 0; // The next line to scan for a directive.
+        lex_state state_{};
+    };
+
+    std::vector<frame> stack_;
+
+    size_t size() const { return text_begin_.size(); }
+
+    std::string_view name_of(uint32_t _src) const {
+        return std::string_view{names_}.substr(name_begin_[_src], name_begin_[_src + 1] - name_begin_[_src]);
+    }
+
+    std::string_view text_of(uint32_t _src) const {
+        return std::string_view{texts_}.substr(text_begin_[_src], text_size_[_src]);
+    }
+
+    uint32_t find(std::string_view _name) const {
+        if (table_.empty()) { return npos; }
+        const size_t mask = table_.size() - 1;
+        for (size_t slot = std::hash<std::string_view>{}(_name) & mask;; slot = (slot + 1) & mask) {
+            if (table_[slot] == npos || name_of(table_[slot]) == _name) { return table_[slot]; }
+        }
+    }
+
+    void insert(uint32_t _src) {
+        const size_t mask = table_.size() - 1;
+        size_t slot = std::hash<std::string_view>{}(name_of(_src)) & mask;
+        while (table_[slot] != npos) { slot = (slot + 1) & mask; }
+        table_[slot] = _src;
+    }
+
+    // Keep the table at most 3/4 full.
+    void rehash(size_t _sources) {
+        size_t slots = 16;
+        while (slots * 3 < _sources * 4) { slots *= 2; }
+        if (slots <= table_.size()) { return; }
+        table_.assign(slots, npos);
+        for (uint32_t src = 0; src < size(); ++src) { insert(src); }
+    }
+
+    // Append bytes to a pool, and get their offset.
+    static uint32_t append(std::string &_pool, std::string_view _bytes) {
+        if (_pool.size() + _bytes.size() > UINT32_MAX) {
+            throw std::runtime_error("glsl_include - Too many bytes for a compact include.");
+        }
+        const uint32_t begin = static_cast<uint32_t>(_pool.size());
+        _pool.append(_bytes);
+        return begin;
+    }
+
+    // Scan from a line for the next directive, skipping block comments and `#if 0` groups like glsl_include does.
+    static std::optional<include_directive> next_directive(std::string_view _text, uint32_t &_line, lex_state &_state) {
+        while (_line < _text.size()) {
+            std::optional<include_directive> found;
+            if (_state.active()) { found = directive::parse(_text, _line); }
+            _state = directive::lex(_text, _line, _state);
+            _line = static_cast<uint32_t>(directive::line_end(_text, _line) + 1);
+            if (found) { return found; }
+        }
+        return std::nullopt;
+    }
+
+    void resolve() {
+        if (resolved_) { return; }
+        first_edge_.clear();
+        edges_.clear();
+        first_edge_.reserve(size() + 1);
+        for (uint32_t src = 0; src < size(); ++src) {
+            first_edge_.push_back(static_cast<uint32_t>(edges_.size()));
+            directive::for_each(text_of(src), [&](const include_directive &_directive) {
+                const uint32_t incl = find(_directive.name);
+                if (incl == npos) {
+                    throw std::runtime_error("glsl_include - Cannot include missing source " + std::string{_directive.name} + ".");
+                }
+                edges_.push_back(incl);
+            });
+        }
+        first_edge_.push_back(static_cast<uint32_t>(edges_.size()));
+        first_edge_.shrink_to_fit();
+        edges_.shrink_to_fit();
+        emitted_.assign(size(), 0);
+        emitted_.shrink_to_fit();
+        on_path_.assign(size(), false);
+        on_path_.shrink_to_fit();
+        epoch_ = 0;
+        resolved_ = true;
+    }
+
+    template<typename T>
+    static size_t bytes(const std::vector<T> &_vector) { return _vector.capacity() * sizeof(T); }
+
+ public:
+    glsl_compact_include() = default;
+
+    ~glsl_compact_include() = default;
+
+    /**
+     * Reserve memory for sources, so the pools and per-source arrays are allocated once.
+     * @param _sources The number of sources.
+     * @param _name_bytes The total length of their names.
+     * @param _text_bytes The total length of their texts.
+     */
+    void reserve(size_t _sources, size_t _name_bytes, size_t _text_bytes) {
+        names_.reserve(_name_bytes);
+        name_begin_.reserve(_sources + 1);
+        texts_.reserve(_text_bytes);
+        text_begin_.reserve(_sources);
+        text_size_.reserve(_sources);
+        rehash(_sources);
+    }
+
+    /**
+     * Add a source. If a source with the same name exists, its text is replaced, and the old text stays in the pool.
+     * @param _name The name of the source.
+     * @param _source The actual contents of your shader.
+     */
+    void add(std::string_view _name, std::string_view _source) {
+        resolved_ = false;
+        if (const uint32_t src = find(_name); src != npos) {
+            text_begin_[src] = append(texts_, _source);
+            text_size_[src] = static_cast<uint32_t>(_source.size());
+            return;
+        }
+        if (size() + 1 >= npos) {
+            throw std::runtime_error("glsl_include - Too many sources for a compact include.");
+        }
+        text_begin_.push_back(append(texts_, _source));
+        text_size_.push_back(static_cast<uint32_t>(_source.size()));
+        append(names_, _name);
+        name_begin_.push_back(static_cast<uint32_t>(names_.size()));
+        rehash(size());
+        insert(static_cast<uint32_t>(size() - 1));
+    }
+
+    /**
+     * @return The number of sources.
+     */
+    size_t num_sources() const { return size(); }
+
+    bool contains(std::string_view _name) const { return find(_name) != npos; }
+
+    /**
+     * Merge a root and every source it includes, with the same output as glsl_include::merge().
+     * The includes of every source are resolved on the first merge after sources are added.
+     * @param _root The name of the root source.
+     * @return The merged source.
+     */
+    std::string merge(std::string_view _root) {
+        resolve();
+        const uint32_t root = find(_root);
+        if (root == npos) {
+            throw std::runtime_error("glsl_include - Cannot find source " + std::string{_root} + ".");
+        }
+        if (++epoch_ == 0) {
+            std::fill(emitted_.begin(), emitted_.end(), 0);
+            epoch_ = 1;
+        }
+        for (const frame &left : stack_) { on_path_[left.src_] = false; } // Left by a merge which threw.
+
+        std::string out;
+        stack_.clear();
+        stack_.push_back(frame{root, first_edge_[root]});
+        emitted_[root] = epoch_;
+        on_path_[root] = true;
+        while (!stack_.empty()) {
+            frame &top = stack_.back();
+            const std::string_view text = text_of(top.src_);
+            const std::optional<include_directive> found = next_directive(text, top.line_, top.state_);
+            if (!found) {
+                out.append(text.substr(top.pos_));
+                on_path_[top.src_] = false;
+                stack_.pop_back();
+                continue;
+            }
+
+            const uint32_t incl = edges_[top.edge_++];
+            out.append(text.substr(top.pos_, found->begin - top.pos_));
+            if (on_path_[incl]) {
+                throw std::runtime_error("glsl_include - Cyclic dependency detected.");
+            }
+            if (emitted_[incl] == epoch_) {
+                top.pos_ = static_cast<uint32_t>(found->erase_end);
+                continue;
+            }
+            top.pos_ = static_cast<uint32_t>(found->splice_end);
+            emitted_[incl] = epoch_;
+            on_path_[incl] = true;
+            stack_.push_back(frame{incl, first_edge_[incl]}); // Invalidates top.
+        }
+        return out;
+    }
+
+    /**
+     * Get the memory allocated by this glsl_compact_include. Texts are counted as sources, the name pool as names,
+     * and the per-source arrays, the name table, the includes and the merge state as graph.
+     * @return The bytes allocated in each category.
+     */
+    memory_usage memory() const {
+        memory_usage out;
+        out.sources = texts_.capacity();
+        out.names = names_.capacity();
+        out.graph = bytes(name_begin_) + bytes(text_begin_) + bytes(text_size_) + bytes(table_) + bytes(first_edge_) + bytes(edges_) +
+                    bytes(emitted_) + on_path_.capacity() / 8 + bytes(stack_);
+        return out;
+    }
+};
+}
@@ -0,0 +1,177 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Scanner for `#include <name>` directives.
+// Every function here is constexpr, so the same rules apply to sources merged at runtime and at compile time.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace mkr {
+/**
+ * The location of an `#include <name>` directive within a source.
+ * When the included source is spliced in, it replaces [begin, splice_end), so anything after the `>` is kept.
+ * When the included source has already been emitted, the whole directive line [begin, erase_end) is erased.
+ */
+struct include_directive {
+    std::size_t begin = 0; // Start of the line containing the directive.
+    std::size_t splice_end = 0; // One past the closing `>`.
+    std::size_t erase_end = 0; // One past the trailing whitespace and newline.
+    std::string_view name{}; // The name between the angle brackets.
+};
+
+/**
+ * The lexer state at the start of a line. Directives are only recognised on lines which start in the default state.
+ */
+struct lex_state {
+    bool comment = false; // Inside a block comment.
+    std::uint32_t inactive = 0; // The depth of conditionals inside an `#if 0` group, or 0 if the line is not skipped.
+
+    constexpr bool active() const { return !comment && inactive == 0; }
+
+    constexpr bool operator==(const lex_state &) const = default;
+};
+
+namespace directive {
+constexpr bool is_blank(char _c) {
+    return _c == ' ' || _c == '\t' || _c == '\r' || _c == '\f' || _c == '\v';
+}
+
+constexpr bool is_name_char(char _c) {
+    return (_c >= 'a' && _c <= 'z') || (_c >= 'A' && _c <= 'Z') || (_c >= '0' && _c <= '9') || _c == '_' || _c == '.';
+}
+
+/**
+ * Get the end of the line starting at _begin, excluding the newline.
+ */
+constexpr std::size_t line_end(std::string_view _source, std::size_t _begin) {
+    std::size_t end = _source.find('\n', _begin);
+    return end == std::string_view::npos ? _source.size() : end;
+}
+
+/**
+ * Parse the line starting at _begin as an include directive.
+ * The directive must be the first thing on its line, and may be indented.
+ * @param _source The source to scan.
+ * @param _begin The start of a line in _source.
+ * @return The directive, or std::nullopt if the line is not an include directive.
+ */
+constexpr std::optional<include_directive> parse(std::string_view _source, std::size_t _begin) {
+    constexpr std::string_view keyword = "#include";
+    const std::size_t end = line_end(_source, _begin);
+
+    std::size_t pos = _begin;
+    while (pos < end && is_blank(_source[pos])) { ++pos; }
+    if (_source.substr(pos, keyword.size()) != keyword) { return std::nullopt; }
+    pos += keyword.size();
+
+    const std::size_t blanks = pos;
+    while (pos < end && is_blank(_source[pos])) { ++pos; }
+    if (pos == blanks || pos == end || _source[pos] != '<') { return std::nullopt; }
+
+    const std::size_t name_begin = ++pos;
+    while (pos < end && is_name_char(_source[pos])) { ++pos; }
+    if (pos == name_begin || pos == end || _source[pos] != '>') { return std::nullopt; }
+
+    include_directive out;
+    out.begin = _begin;
+    out.name = _source.substr(name_begin, pos - name_begin);
+    out.splice_end = ++pos;
+    while (pos < end && is_blank(_source[pos])) { ++pos; }
+    out.erase_end = (pos == end && end < _source.size()) ? end + 1 : pos;
+    return out;
+}
+
+/**
+ * Lex the line starting at _begin, to get the state at the start of the next line.
+ * Tracks block comments, and `#if 0` groups up to their `#else`, `#elif` or `#endif`. Other conditionals are assumed to be active.
+ * @param _source The source to scan.
+ * @param _begin The start of a line in _source.
+ * @param _state The state at the start of the line.
+ * @return The state at the start of the next line.
+ */
+constexpr lex_state lex(std::string_view _source, std::size_t _begin, lex_state _state) {
+    const std::size_t end = line_end(_source, _begin);
+    auto skip_blanks = [&](std::size_t _pos) {
+        while (_pos < end && is_blank(_source[_pos])) { ++_pos; }
+        return _pos;
+    };
+    auto word_at = [&](std::size_t _pos) {
+        std::size_t word_end = _pos;
+        while (word_end < end && is_name_char(_source[word_end])) { ++word_end; }
+        return _source.substr(_pos, word_end - _pos);
+    };
+
+    std::size_t pos = skip_blanks(_begin);
+    if (!_state.comment && pos < end && _source[pos] == '#') {
+        const std::size_t keyword_begin = skip_blanks(pos + 1);
+        const std::string_view keyword = word_at(keyword_begin);
+        if (_state.inactive != 0) {
+            if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef") {
+                ++_state.inactive;
+            } else if (keyword == "endif" || (_state.inactive == 1 && (keyword == "else" || keyword == "elif"))) {
+                --_state.inactive;
+            }
+        } else if (keyword == "if" && word_at(skip_blanks(keyword_begin + keyword.size())) == "0") {
+            _state.inactive = 1;
+        }
+    }
+
+    for (; pos + 1 < end; ++pos) {
+        if (_state.comment) {
+            if (_source.substr(pos, 2) == "*/") {
+                _state.comment = false;
+                ++pos;
+            }
+        } else if (_source[pos] == '/' && _source[pos + 1] == '/') {
+            break;
+        } else if (_source[pos] == '/' && _source[pos + 1] == '*') {
+            _state.comment = true;
+            ++pos;
+        }
+    }
+    return _state;
+}
+
+/**
+ * Call _fn for every include directive in _source, in order of appearance.
+ * Directives inside block comments and `#if 0` groups are skipped.
+ */
+template<typename Fn>
+constexpr void for_each(std::string_view _source, Fn &&_fn) {
+    lex_state state;
+    for (std::size_t line = 0; line < _source.size(); line = line_end(_source, line) + 1) {
+        if (state.active()) {
+            if (auto found = parse(_source, line)) {
+                _fn(*found);
+            }
+        }
+        state = lex(_source, line, state);
+    }
+}
+
+/**
+ * Count the include directives in _source.
+ */
+constexpr std::size_t count(std::string_view _source) {
+    std::size_t n = 0;
+    for_each(_source, [&n](const include_directive &) { ++n; });
+    return n;
+}
+
+/**
+ * Get the _index-th include directive in _source.
+ */
+constexpr include_directive at(std::string_view _source, std::size_t _index) {
+    include_directive out;
+    std::size_t n = 0;
+    for_each(_source, [&](const include_directive &_directive) {
+        if (n++ == _index) { out = _directive; }
+    });
+    return out;
+}
+}
+}
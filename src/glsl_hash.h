@@ -0,0 +1,197 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Content hashes of sources.
+
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace mkr {
+/**
+ * A fast, non-cryptographic 64-bit hash which can be fed in pieces.
+ * Feeding the same bytes gives the same digest, however they are split into pieces.
+ */
+class hasher {
+ private:
+    static constexpr uint64_t multiplier_ = 0x9E3779B97F4A7C15ull;
+
+    uint64_t state_ = 0xCBF29CE484222325ull;
+    uint64_t word_ = 0;
+    uint64_t length_ = 0;
+    unsigned fill_ = 0; // Bytes in word_.
+
+    void mix(uint64_t _word) {
+        state_ = (std::rotl(state_, 23) ^ _word) * multiplier_;
+    }
+
+ public:
+    hasher() = default;
+
+    explicit hasher(uint64_t _seed) : state_(_seed ^ 0xCBF29CE484222325ull) {}
+
+    ~hasher() = default;
+
+    hasher &update(std::string_view _bytes) {
+        const char *data = _bytes.data();
+        size_t len = _bytes.size();
+        length_ += len;
+
+        for (; fill_ != 0 && len != 0; --len) {
+            word_ |= static_cast<uint64_t>(static_cast<unsigned char>(*data++)) << (8 * fill_);
+            if (++fill_ == 8) {
+                mix(word_);
+                word_ = 0;
+                fill_ = 0;
+            }
+        }
+        for (; len >= 8; len -= 8, data += 8) {
+            uint64_t word;
+            std::memcpy(&word, data, 8);
+            if constexpr (std::endian::native == std::endian::big) { word = std::byteswap(word); }
+            mix(word);
+        }
+        for (; len != 0; --len) {
+            word_ |= static_cast<uint64_t>(static_cast<unsigned char>(*data++)) << (8 * fill_++);
+        }
+        return *this;
+    }
+
+    hasher &update(uint64_t _value) {
+        char bytes[8];
+        for (char &byte : bytes) {
+            byte = static_cast<char>(_value & 0xFF);
+            _value >>= 8;
+        }
+        return update(std::string_view{bytes, 8});
+    }
+
+    uint64_t digest() const {
+        uint64_t out = state_;
+        out = (std::rotl(out, 23) ^ word_ ^ (static_cast<uint64_t>(fill_) << 56)) * multiplier_;
+        out ^= length_;
+        // Final avalanche, from MurmurHash3.
+        out ^= out >> 33;
+        out *= 0xFF51AFD7ED558CCDull;
+        out ^= out >> 33;
+        out *= 0xC4CEB9FE1A85EC53ull;
+        out ^= out >> 33;
+        return out;
+    }
+
+    /**
+     * Hash a string of bytes.
+     */
+    static uint64_t of(std::string_view _bytes) {
+        return hasher{}.update(_bytes).digest();
+    }
+
+    /**
+     * Hash a source, ignoring comments and insignificant whitespace.
+     * Tokens are maximal runs of identifier characters, or single other characters.
+     * Whitespace is only significant between two identifiers, between two operator characters (so `+ +` differs from `++`),
+     * and inside preprocessor lines, where a run of whitespace counts as a single space (so `#define F(x)` differs from `#define F (x)`)
+     * and the line break is kept. Edits which only touch comments or other whitespace do not change the hash.
+     */
+    static uint64_t semantic(std::string_view _source);
+};
+
+/**
+ * Computes hasher::semantic() of a source which is fed one line at a time, so the source does not have to be held whole.
+ * Each piece must be a whole line including its newline, except for the last line of the source.
+ */
+class semantic_hasher {
+ private:
+    hasher out_;
+    bool comment_ = false; // Inside a block comment.
+    bool preprocessor_ = false; // Whether the current line is a preprocessor line.
+    bool line_has_tokens_ = false;
+    bool space_ = false; // Whether there is whitespace before the next token.
+    bool last_operator_ = false; // Whether the last token was an operator character.
+
+    static bool is_word(char _c) {
+        return (_c >= 'a' && _c <= 'z') || (_c >= 'A' && _c <= 'Z') || (_c >= '0' && _c <= '9') || _c == '_' || _c == '.';
+    }
+
+    static bool is_space(char _c) {
+        return _c == ' ' || _c == '\t' || _c == '\r' || _c == '\f' || _c == '\v';
+    }
+
+ public:
+    semantic_hasher() = default;
+
+    ~semantic_hasher() = default;
+
+    semantic_hasher &update(std::string_view _line) {
+        constexpr std::string_view separator = "\x1F";
+        constexpr std::string_view operators = "+-*/%<>=!&|^";
+        const size_t size = _line.size();
+        size_t pos = 0;
+        while (pos < size) {
+            if (comment_) {
+                const size_t end = _line.find("*/", pos);
+                if (end == std::string_view::npos) { break; }
+                comment_ = false;
+                pos = end + 2;
+                continue;
+            }
+
+            const char c = _line[pos];
+            const char next = pos + 1 < size ? _line[pos + 1] : '\0';
+            if (c == '\n' && preprocessor_) {
+                out_.update(std::string_view{"\n"});
+                preprocessor_ = line_has_tokens_ = space_ = last_operator_ = false;
+                ++pos;
+            } else if (c == '\n') {
+                space_ = true; // Elsewhere a line break is whitespace, so `+\n+` still differs from `++`.
+                preprocessor_ = line_has_tokens_ = false;
+                ++pos;
+            } else if (is_space(c)) {
+                space_ = true;
+                ++pos;
+            } else if (c == '\\' && (next == '\n' || (next == '\r' && pos + 2 < size && _line[pos + 2] == '\n'))) {
+                space_ = true; // Line continuation.
+                pos += next == '\n' ? 2 : 3;
+            } else if (c == '/' && next == '/') {
+                space_ = true;
+                pos = _line.find('\n', pos);
+                pos = pos == std::string_view::npos ? size : pos;
+            } else if (c == '/' && next == '*') {
+                space_ = true;
+                comment_ = true;
+                pos += 2;
+            } else {
+                size_t end = pos + 1;
+                if (is_word(c)) {
+                    while (end < size && is_word(_line[end])) { ++end; }
+                }
+                const bool is_operator = operators.find(c) != std::string_view::npos;
+                if (!line_has_tokens_ && c == '#') { preprocessor_ = true; }
+                if (space_ && ((line_has_tokens_ && preprocessor_) || (last_operator_ && is_operator))) { out_.update(std::string_view{" "}); }
+                out_.update(_line.substr(pos, end - pos));
+                if (is_word(c)) { out_.update(separator); }
+                line_has_tokens_ = true;
+                space_ = false;
+                last_operator_ = is_operator;
+                pos = end;
+            }
+        }
+        return *this;
+    }
+
+    uint64_t digest() const { return out_.digest(); }
+};
+
+inline uint64_t hasher::semantic(std::string_view _source) {
+    semantic_hasher out;
+    for (size_t line = 0; line < _source.size();) {
+        const size_t newline = _source.find('\n', line);
+        const size_t end = newline == std::string_view::npos ? _source.size() : newline + 1;
+        out.update(_source.substr(line, end - line));
+        line = end;
+    }
+    return out.digest();
+}
+}
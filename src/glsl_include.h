@@ -5,149 +5,1716 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
-#include <regex>
+#include <string_view>
 #include <functional>
 #include <unordered_map>
 #include <unordered_set>
 #include <map>
-#include <stack>
 #include <vector>
-#include <queue>
+#include <optional>
+#include <stdexcept>
+#include <atomic>
+#include <memory>
+#include <list>
+#include <future>
+#include <thread>
+#include <filesystem>
+#include <concepts>
+#include <ostream>
+#include <chrono>
+#include <utility>
+#include <iterator>
+#include <version>
+#ifdef __cpp_lib_generator
+#include <generator>
+#endif
+#include "glsl_directive.h"
+#include "glsl_hash.h"
+#include "glsl_analysis_worker.h"
+#include "glsl_line_table.h"
+#include "glsl_memory.h"
+#include "glsl_persistent_map.h"
+#include "glsl_stream.h"
 
 namespace mkr {
+/**
+ * Thrown by a merge which has been cancelled.
+ */
+class merge_cancelled : public std::runtime_error {
+ public:
+    merge_cancelled() : std::runtime_error("glsl_include - Merge cancelled.") {}
+};
+
+/**
+ * Cancels a merge from another thread. Copies of a token share the same state.
+ * A merge checks its token between phases and between sources, and throws merge_cancelled once it is cancelled.
+ */
+class cancel_token {
+ private:
+    std::shared_ptr<std::atomic<bool>> cancelled_ = std::make_shared<std::atomic<bool>>(false);
+
+ public:
+    cancel_token() = default;
+
+    ~cancel_token() = default;
+
+    void cancel() { cancelled_->store(true, std::memory_order_relaxed); }
+
+    bool cancelled() const { return cancelled_->load(std::memory_order_relaxed); }
+
+    /**
+     * @throws merge_cancelled If the token has been cancelled.
+     */
+    void check() const {
+        if (cancelled()) { throw merge_cancelled(); }
+    }
+};
+
+/**
+ * The result of glsl_include::remerge().
+ */
+struct remerge_result {
+    bool changed = true; // Whether the merged bytes differ from the last remerge of the root.
+    bool assembled = true; // Whether the merged source was assembled. If not, the output was left untouched.
+    uint64_t hash = 0; // The hash of the merged bytes.
+    size_t length = 0; // The length of the merged bytes.
+};
+
+/**
+ * When glsl_include analyses a source, which finds its directives and hashes the text around them.
+ */
+enum class analysis_policy : uint8_t {
+    on_merge, // When a merge first reaches the source. Adding a source only stores it.
+    on_add, // When the source is added or updated, so merges never scan text.
+    background, // On a worker thread, queued when the source is added or updated. Merges wait only for the sources they reach.
+};
+
+/**
+ * Statistics of the cache of merged outputs.
+ */
+struct cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0; // Entries dropped to stay within the budget.
+    uint64_t invalidations = 0; // Entries dropped because a source they reach was removed.
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t budget = 0;
+};
+
 class glsl_include {
  private:
-    std::unordered_map<std::string /* Name */, std::string /* Source */> srcs_;
+    struct source_blob;
+
+ public:
+    using line_table_type = basic_line_table<tracked_allocator<uint32_t>>;
+    using output_ptr = std::shared_ptr<const std::string>; // A merged output which can be shared without copying.
+    using shared_source = std::shared_ptr<const source_blob>; // A source which can be added to many glsl_includes without copying.
+
+ private:
+    // The lexer state from the start of a line, until the next run.
+    struct lex_run {
+        size_t begin_ = 0;
+        lex_state state_;
+    };
+
+    // What a merge needs to know about a source, computed from its text once.
+    struct source_analysis {
+        tracked_vector<include_directive> directives_;
+        tracked_vector<uint64_t> segment_hashes_; // The hash of the text before each directive, and of the text after the last one.
+        tracked_vector<uint64_t> tail_hashes_; // The hash of the text that each directive keeps after its `>` when it is spliced.
+        tracked_vector<lex_run> lex_runs_; // Lines before the first run start in the default state.
+
+        // A leaf includes nothing, so its merge is its text.
+        bool leaf() const { return directives_.empty(); }
+    };
+
+    // A source whose text stays in a file, and is read in chunks whenever it is needed.
+    struct source_file {
+        tracked_string path_;
+        uint64_t size_ = 0;
+        size_t chunk_size_ = 0;
+        tracked_string names_; // The names of the directives, which cannot point into the text.
+    };
+
+    // The text of a source, and what is computed from it. Its memory is counted by the glsl_include which created it.
+    // A blob is fully analysed before it is shared, and is never changed while it is shared.
+    struct source_blob {
+        tracked_string text_; // Empty if the text is in a file.
+        std::optional<source_file> file_;
+        std::optional<source_analysis> analysis_; // Computed on first use.
+        std::optional<uint64_t> content_hash_; // Computed on first use.
+    };
+
+    struct source_entry {
+        std::shared_ptr<source_blob> blob_;
+        mutable std::optional<line_table_type> lines_{}; // Built on first use.
+        mutable std::optional<uint64_t> semantic_hash_{}; // Computed on first use.
 
-    static std::string get_name(const std::string &_line) {
-        static const std::regex spec(R"(<[a-zA-z0-9_.]+>)", std::regex::ECMAScript);
-        std::smatch match;
-        std::regex_search(_line, match, spec);
-        return match.str().substr(1, match.str().length() - 2);
+        const tracked_string &text() const { return blob_->text_; }
+
+        uint64_t size() const { return blob_->file_ ? blob_->file_->size_ : blob_->text_.size(); }
+    };
+
+    // Names are looked up by std::string_view, so that std::string and tracked_string keys compare with each other.
+    struct string_hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view _str) const { return std::hash<std::string_view>{}(_str); }
+    };
+
+    struct string_equal {
+        using is_transparent = void;
+        bool operator()(std::string_view _lhs, std::string_view _rhs) const { return _lhs == _rhs; }
+    };
+
+    // The last remerge of a root.
+    struct output_record {
+        uint64_t input_hash_ = 0; // Combines the hashes of every segment that contributed to the output.
+        uint64_t hash_ = 0;
+        size_t length_ = 0;
+    };
+
+    // Every allocation below counts into these, by category.
+    std::shared_ptr<memory_counters> counters_ = std::make_shared<memory_counters>();
+
+    template<typename T>
+    tracked_allocator<T> allocator(memory_category _category) const {
+        return tracked_allocator<T>{counters_, _category};
     }
 
-    static std::unordered_set<std::string> get_includes(const std::string &_source) {
-        static const std::regex spec(R"(^[\s]*#include[\s]+<[a-zA-z0-9_.]+>[\s\r\n]*)", std::regex::ECMAScript | std::regex::multiline);
-        std::unordered_set<std::string> out;
-        std::smatch match;
-        std::string::const_iterator iter(_source.cbegin());
-        while (iter != _source.end()) {
-            std::regex_search(iter, _source.cend(), match, spec);
-            if (!match.empty()) {
-                std::string name = get_name(match.str());
-                out.insert(name);
+    // Declared before the sources, so that moving a glsl_include stops the old worker before the old sources are destroyed.
+    std::unique_ptr<analysis_worker> worker_;
+
+    // Copies of a glsl_include share the index and its entries, until one of them changes an entry.
+    // An entry keeps its address for as long as it is in the index and unchanged, so merges and caches refer to it by address.
+    using source_map = persistent_map<tracked_string /* Name */, source_entry, string_hash, string_equal, tracked_allocator<char>>;
+    source_map srcs_{allocator<char>(memory_category::graph)};
+    tracked_vector<source_map> layers_{allocator<source_map>(memory_category::graph)}; // Shared from other glsl_includes, from the bottom up.
+    tracked_map<tracked_string /* Root */, output_record, string_hash, string_equal> outputs_{allocator<char>(memory_category::graph)};
+
+    // A merged output in the cache.
+    struct cache_entry {
+        tracked_string root_;
+        output_ptr output_; // Shared with every caller which was served it.
+        tracked_vector<const source_entry *> sources_; // Every source the merge reached.
+        size_t bytes_ = 0;
+    };
+
+    using cache_list = tracked_list<cache_entry>;
+    using root_set = tracked_set<tracked_string, string_hash, string_equal>;
+
+    // The cache is ordered from the most recently used to the least recently used entry.
+    cache_list cache_{allocator<char>(memory_category::caches)};
+    tracked_map<tracked_string /* Root */, cache_list::iterator, string_hash, string_equal> cache_index_{allocator<char>(memory_category::caches)};
+    tracked_map<const source_entry *, root_set /* Roots */> cache_dependents_{allocator<char>(memory_category::caches)};
+    size_t cache_budget_ = 0;
+    cache_stats cache_stats_;
+    analysis_policy policy_ = analysis_policy::on_merge;
+
+    // The state of a source during a batch of merges. It is kept across the merges of a batch,
+    // so each source is scanned once per batch, and the scratch maps are only allocated once.
+    struct node_scratch {
+        const source_entry *src_ = nullptr;
+        const source_analysis *analysis_ = nullptr;
+        uint32_t first_include_ = 0, num_includes_ = 0; // The node included by each directive, in merge_scratch::includes_.
+        size_t epoch_ = 0; // The merge which last visited this source.
+        size_t emitted_ = 0; // 1 + the position of this source in that merge's emission order, or 0 if it is not emitted.
+        bool on_path_ = false;
+
+        // Where the full expansion of this source was written, if it is known.
+        // A full expansion is one made while nothing it includes had been emitted yet, so it can be copied into any merge
+        // which has not emitted any of those sources either.
+        bool expanded_ = false;
+        size_t output_ = 0; // The output holding the expansion.
+        size_t begin_ = 0, length_ = 0; // The expansion's bytes in that output.
+        size_t first_ = 0, count_ = 0; // The sources it emits, in that output's emission order.
+    };
+
+    // A source being expanded by expand().
+    struct expand_frame {
+        node_scratch *node_ = nullptr;
+        uint32_t next_ = 0; // The next directive.
+        uint64_t pos_ = 0; // The next byte of the text to copy.
+        size_t begin_ = 0; // Where the expansion starts in the output.
+        size_t earliest_ = SIZE_MAX; // The earliest emitted source whose directive was erased, to tell if the expansion is full.
+    };
+
+    // A source whose includes are being walked by walk().
+    struct walk_frame {
+        node_scratch *node_ = nullptr;
+        uint32_t next_ = 0; // The next include.
+    };
+
+    struct merge_scratch {
+        std::unordered_map<const source_entry *, node_scratch> nodes_;
+        std::vector<node_scratch *> includes_; // The includes of every node, one node after another.
+        std::vector<std::shared_ptr<std::string>> outputs_; // Null for outputs served from the cache, which no expansion refers to.
+        std::vector<std::vector<const source_entry *>> emitted_; // The emission order of each output.
+        std::vector<expand_frame> frames_; // The stack of expand(), kept to reuse its memory.
+        size_t epoch_ = 0;
+        const cancel_token *token_ = nullptr;
+    };
+
+    static void check(const cancel_token *_token) {
+        if (_token) { _token->check(); }
+    }
+
+    // The sources as a graph with dense node IDs, for the passes over every source.
+    // Each field of the nodes is kept in an array of its own, indexed by node ID, so a pass streams through the fields it needs
+    // instead of hashing a name at every step. The edges of node i are targets_[first_edge_[i], first_edge_[i + 1]).
+    struct source_graph {
+        std::vector<std::string_view> names_;
+        std::vector<const source_entry *> sources_;
+        std::vector<const source_analysis *> analyses_;
+        std::vector<uint32_t> first_edge_;
+        std::vector<uint32_t> targets_;
+        std::vector<uint32_t> in_degrees_;
+
+        size_t size() const { return names_.size(); }
+
+        // The graph with every edge reversed, as an array of the first edge of each node and an array of targets.
+        std::pair<std::vector<uint32_t>, std::vector<uint32_t>> reversed() const {
+            std::vector<uint32_t> first_edge(size() + 1, 0);
+            for (size_t i = 0; i < size(); ++i) { first_edge[i + 1] = first_edge[i] + in_degrees_[i]; }
+            std::vector<uint32_t> fill(first_edge.begin(), first_edge.end() - 1);
+            std::vector<uint32_t> targets(targets_.size());
+            for (uint32_t from = 0; from < size(); ++from) {
+                for (uint32_t edge = first_edge_[from]; edge < first_edge_[from + 1]; ++edge) {
+                    targets[fill[targets_[edge]]++] = from;
+                }
+            }
+            return {std::move(first_edge), std::move(targets)};
+        }
+    };
+
+    // The edges come from the analysis of each source, so sources which have already been analysed are not scanned again.
+    // _missing(node, name) is called for every include of a name which does not resolve, and the include is left out of the graph.
+    template<typename Fn>
+    source_graph build_graph(const cancel_token *_token, Fn &&_missing) const {
+        source_graph graph;
+        for_each_source([&](const tracked_string &_name, const source_entry &_src) {
+            graph.names_.push_back(_name);
+            graph.sources_.push_back(&_src);
+        });
+        if (graph.size() > UINT32_MAX) {
+            throw std::runtime_error("glsl_include - Too many sources.");
+        }
+
+        std::unordered_map<std::string_view, uint32_t> ids;
+        ids.reserve(graph.size());
+        for (uint32_t i = 0; i < graph.size(); ++i) { ids.emplace(graph.names_[i], i); }
+
+        graph.analyses_.reserve(graph.size());
+        graph.first_edge_.reserve(graph.size() + 1);
+        graph.in_degrees_.assign(graph.size(), 0);
+        for (uint32_t i = 0; i < graph.size(); ++i) {
+            check(_token);
+            graph.analyses_.push_back(&analyse(*graph.sources_[i]));
+            graph.first_edge_.push_back(static_cast<uint32_t>(graph.targets_.size()));
+            for (const include_directive &directive : graph.analyses_[i]->directives_) {
+                auto iter = ids.find(directive.name);
+                if (iter == ids.end()) {
+                    _missing(i, directive.name);
+                    continue;
+                }
+                graph.targets_.push_back(iter->second);
+                ++graph.in_degrees_[iter->second];
             }
-            iter = match.suffix().first;
         }
+        graph.first_edge_.push_back(static_cast<uint32_t>(graph.targets_.size()));
+        return graph;
+    }
+
+    // Using toposort, we can ensure that there are no cyclic dependencies.
+    // @return The ID of the only source which is not included by any other source.
+    static uint32_t toposort(const source_graph &_graph) {
+        std::vector<uint32_t> in_degrees = _graph.in_degrees_;
+        std::vector<uint32_t> queue;
+        queue.reserve(_graph.size());
+        for (uint32_t i = 0; i < _graph.size(); ++i) {
+            if (in_degrees[i] == 0) { queue.push_back(i); }
+        }
+
+        if (queue.size() != 1) {
+            throw std::runtime_error("glsl_include - There must be exactly 1 file which is not included by any other file.");
+        }
+
+        const uint32_t root = queue.front();
+        for (size_t next = 0; next < queue.size(); ++next) {
+            const uint32_t from = queue[next];
+            for (uint32_t edge = _graph.first_edge_[from]; edge < _graph.first_edge_[from + 1]; ++edge) {
+                if (--in_degrees[_graph.targets_[edge]] == 0) {
+                    queue.push_back(_graph.targets_[edge]);
+                }
+            }
+        }
+
+        if (queue.size() != _graph.size()) {
+            throw std::runtime_error("glsl_include - Cyclic dependency detected.");
+        }
+        return root;
+    }
+
+    static source_analysis make_analysis(const tracked_allocator<char> &_alloc) {
+        return source_analysis{tracked_vector<include_directive>(_alloc), tracked_vector<uint64_t>(_alloc), tracked_vector<uint64_t>(_alloc),
+                               tracked_vector<lex_run>(_alloc)};
+    }
+
+    source_analysis make_analysis() const {
+        return make_analysis(allocator<char>(memory_category::metadata));
+    }
+
+    // Scan a line for a directive, and lex it to get the state at the start of the next line.
+    static lex_state scan_line(source_analysis &_out, std::string_view _text, size_t _line, lex_state _state) {
+        if (_state.active()) {
+            if (auto found = directive::parse(_text, _line)) {
+                _out.directives_.push_back(*found);
+                _out.tail_hashes_.push_back(hasher::of(_text.substr(found->splice_end, found->erase_end - found->splice_end)));
+            }
+        }
+        const lex_state next = directive::lex(_text, _line, _state);
+        const size_t next_line = directive::line_end(_text, _line) + 1;
+        if (next != _state && next_line < _text.size()) {
+            _out.lex_runs_.push_back(lex_run{next_line, next});
+        }
+        return next;
+    }
+
+    // Hash the segments [_first, _last] around the directives of a source.
+    static void hash_segments(source_analysis &_out, std::string_view _text, size_t _first, size_t _last) {
+        for (size_t i = _first; i <= _last; ++i) {
+            const size_t begin = i == 0 ? 0 : _out.directives_[i - 1].erase_end;
+            const size_t end = i < _out.directives_.size() ? _out.directives_[i].begin : _text.size();
+            _out.segment_hashes_.push_back(hasher::of(_text.substr(begin, end - begin)));
+        }
+    }
+
+    static lex_state state_at(const tracked_vector<lex_run> &_runs, size_t _line) {
+        auto iter = std::upper_bound(_runs.begin(), _runs.end(), _line, [](size_t _pos, const lex_run &_run) { return _pos < _run.begin_; });
+        return iter == _runs.begin() ? lex_state{} : std::prev(iter)->state_;
+    }
+
+    static source_analysis scan(std::string_view _text, const tracked_allocator<char> &_alloc) {
+        source_analysis out = make_analysis(_alloc);
+        lex_state state;
+        for (size_t line = 0; line < _text.size(); line = directive::line_end(_text, line) + 1) {
+            state = scan_line(out, _text, line, state);
+        }
+        hash_segments(out, _text, 0, out.directives_.size());
         return out;
     }
 
-    static std::unordered_map<std::string, std::unordered_set<std::string>> get_out_edges(const std::unordered_map<std::string, std::string> &_srcs) {
-        std::unordered_map<std::string, std::unordered_set<std::string>> out_edges;
-        for (auto &iter : _srcs) {
-            const auto &name = iter.first;
-            const auto &source = iter.second;
-            out_edges[name] = get_includes(source);
+    // Scan a file source chunk by chunk, and hash it. Each line is scanned on its own and its results shifted to where it starts,
+    // so a directive which straddles two chunks is found like any other, and only the line being scanned is ever copied.
+    static void scan_file(source_blob &_blob, const tracked_allocator<char> &_alloc) {
+        source_file &file = *_blob.file_;
+        chunk_reader reader{std::string_view{file.path_}, file.chunk_size_};
+        file.size_ = reader.size();
 
-            // Check that the edges are valid.
-            for (const auto &to : out_edges[name]) {
-                if (_srcs.contains(to)) { continue; }
-                std::string err_msg = "glsl_include - Cannot include missing source " + to + ".";
-                throw std::runtime_error(err_msg);
+        source_analysis out = make_analysis(_alloc);
+        std::vector<size_t> name_begins;
+        hasher content, segment;
+        lex_state state;
+        auto on_line = [&](std::string_view _line, uint64_t _offset) {
+            content.update(_line);
+            size_t kept = 0; // Where the rest of the line starts, after a directive.
+            if (state.active()) {
+                if (auto found = directive::parse(_line, 0)) {
+                    out.segment_hashes_.push_back(segment.digest());
+                    segment = hasher{};
+                    out.tail_hashes_.push_back(hasher::of(_line.substr(found->splice_end, found->erase_end - found->splice_end)));
+                    out.directives_.push_back(include_directive{_offset, _offset + found->splice_end, _offset + found->erase_end});
+                    name_begins.push_back(file.names_.size());
+                    file.names_.append(found->name);
+                    kept = found->erase_end;
+                }
             }
+            segment.update(_line.substr(kept));
+            const lex_state next = directive::lex(_line, 0, state);
+            if (next != state && _offset + _line.size() < file.size_) {
+                out.lex_runs_.push_back(lex_run{_offset + _line.size(), next});
+            }
+            state = next;
+        };
+
+        line_splitter lines;
+        for (std::string_view chunk = reader.read(); !chunk.empty(); chunk = reader.read()) { lines.feed(chunk, on_line); }
+        lines.finish(on_line);
+        out.segment_hashes_.push_back(segment.digest());
+        name_begins.push_back(file.names_.size());
+        for (size_t i = 0; i < out.directives_.size(); ++i) {
+            out.directives_[i].name = std::string_view{file.names_}.substr(name_begins[i], name_begins[i + 1] - name_begins[i]);
+        }
+        _blob.analysis_.emplace(std::move(out));
+        _blob.content_hash_ = content.digest();
+    }
+
+    // Open the file of a file source, which must not have changed size since it was scanned.
+    static chunk_reader open(const source_file &_file) {
+        chunk_reader reader{std::string_view{_file.path_}, _file.chunk_size_};
+        if (reader.size() != _file.size_) {
+            throw std::runtime_error("glsl_include - File " + std::string{_file.path_} + " changed since it was added.");
+        }
+        return reader;
+    }
+
+    // Call _fn with the text of a source in [_begin, _end), in pieces. The text of a file source is read through _reader,
+    // which is opened on first use, so that a source which copies many ranges opens its file once.
+    template<typename Fn>
+    static void read_text(const source_entry &_src, std::optional<chunk_reader> &_reader, uint64_t _begin, uint64_t _end, Fn &&_fn) {
+        if (!_src.blob_->file_) {
+            _fn(std::string_view{_src.text()}.substr(_begin, _end - _begin));
+            return;
         }
-        return out_edges;
+        if (!_reader) { _reader.emplace(open(*_src.blob_->file_)); }
+        _reader->seek(_begin);
+        for (std::string_view chunk = _reader->read(_end); !chunk.empty(); chunk = _reader->read(_end)) { _fn(chunk); }
     }
 
-    static std::unordered_map<std::string, std::unordered_set<std::string>> get_in_edges(std::unordered_map<std::string, std::unordered_set<std::string>> _out_edges) {
-        std::unordered_map<std::string, std::unordered_set<std::string>> in_edges;
-        for (auto &iter : _out_edges) {
-            const auto &from = iter.first;
-            for (const auto &to : iter.second) {
-                in_edges[to].insert(from);
+    template<typename Fn>
+    static void read_text(const source_entry &_src, Fn &&_fn) {
+        std::optional<chunk_reader> reader;
+        read_text(_src, reader, 0, _src.size(), _fn);
+    }
+
+    // Wait for the background analysis of a source, if it is queued or running.
+    void await(const source_entry &_src) const {
+        if (worker_) { worker_->await(&_src); }
+    }
+
+    // Drop the background analysis of a source before it is changed or removed.
+    void cancel_analysis(const source_entry &_src) const {
+        if (worker_) { worker_->cancel(&_src); }
+    }
+
+    const source_analysis &analyse(const source_entry &_src) const {
+        await(_src);
+        if (_src.blob_->analysis_) { return *_src.blob_->analysis_; }
+        return _src.blob_->analysis_.emplace(scan(_src.text(), allocator<char>(memory_category::metadata)));
+    }
+
+    source_entry make_entry(std::string_view _text) const {
+        return source_entry{std::allocate_shared<source_blob>(allocator<source_blob>(memory_category::sources),
+                                                              tracked_string{_text, allocator<char>(memory_category::sources)})};
+    }
+
+    // Give a source a blob of its own before changing it, if its blob is shared or its text is in a file.
+    // The copy is analysed again when it is needed.
+    void unshare(source_entry &_src) const {
+        if (_src.blob_.use_count() == 1 && !_src.blob_->file_) { return; }
+        source_entry copy = make_entry({});
+        copy.blob_->text_.reserve(_src.size());
+        read_text(_src, [&](std::string_view _piece) { copy.blob_->text_.append(_piece); });
+        _src.blob_ = std::move(copy.blob_);
+    }
+
+    // Replace [_offset, _offset + _erase) of a source's text with _insert, and patch its analysis.
+    // Lines are lexed again from the first touched line, until the lexer state after the touched lines matches the old scan,
+    // so an edit which opens a block comment rescans up to where the comment now ends, and a typical edit rescans one line.
+    // The directives, segments and lexer states outside of the rescanned lines are kept, shifted by the change in length.
+    void patch(source_entry &_src, size_t _offset, size_t _erase, std::string_view _insert) const {
+        if (!_src.blob_->analysis_) {
+            _src.blob_->text_.replace(_offset, _erase, _insert);
+            return;
+        }
+
+        const source_analysis &old = *_src.blob_->analysis_;
+        std::vector<size_t> name_offsets;
+        name_offsets.reserve(old.directives_.size());
+        for (const include_directive &directive : old.directives_) {
+            name_offsets.push_back(directive.name.data() - _src.text().data());
+        }
+        _src.blob_->text_.replace(_offset, _erase, _insert);
+
+        // Positions after the touched lines map between the old and new text. Both wrap around, but the results are in range.
+        const std::string_view text = _src.text();
+        auto shift = [&](size_t _pos) { return _pos + _insert.size() - _erase; };
+        auto unshift = [&](size_t _pos) { return _pos + _erase - _insert.size(); };
+        const size_t lo = _offset == 0 ? 0 : text.rfind('\n', _offset - 1) + 1;
+        size_t hi = text.find('\n', _offset + _insert.size());
+        hi = hi == std::string_view::npos ? text.size() : hi + 1;
+
+        source_analysis out = make_analysis();
+        size_t prefix = 0; // Directives before the rescanned lines.
+        for (; prefix < old.directives_.size() && old.directives_[prefix].begin < lo; ++prefix) {
+            include_directive directive = old.directives_[prefix];
+            directive.name = text.substr(name_offsets[prefix], directive.name.size());
+            out.directives_.push_back(directive);
+            out.tail_hashes_.push_back(old.tail_hashes_[prefix]);
+        }
+        for (const lex_run &run : old.lex_runs_) {
+            if (run.begin_ > lo) { break; }
+            out.lex_runs_.push_back(run);
+        }
+
+        lex_state state = state_at(old.lex_runs_, lo);
+        size_t line = lo;
+        for (; line < text.size(); line = directive::line_end(text, line) + 1) {
+            if (line >= hi && state == state_at(old.lex_runs_, unshift(line))) { break; }
+            state = scan_line(out, text, line, state);
+        }
+        const size_t end = std::min(line, text.size()); // The rescanned lines are [lo, end).
+        const size_t old_end = unshift(end);
+        const size_t rescanned = out.directives_.size();
+
+        size_t suffix = prefix; // The first directive after the rescanned lines.
+        while (suffix < old.directives_.size() && old.directives_[suffix].begin < old_end) { ++suffix; }
+        for (size_t i = suffix; i < old.directives_.size(); ++i) {
+            include_directive directive = old.directives_[i];
+            directive.begin = shift(directive.begin);
+            directive.splice_end = shift(directive.splice_end);
+            directive.erase_end = shift(directive.erase_end);
+            directive.name = text.substr(shift(name_offsets[i]), directive.name.size());
+            out.directives_.push_back(directive);
+            out.tail_hashes_.push_back(old.tail_hashes_[i]);
+        }
+        for (const lex_run &run : old.lex_runs_) {
+            if (run.begin_ > old_end) { out.lex_runs_.push_back(lex_run{shift(run.begin_), run.state_}); }
+        }
+
+        // Only the segments which end at a rescanned directive, or at the first directive after them, are hashed again.
+        out.segment_hashes_.assign(old.segment_hashes_.begin(), old.segment_hashes_.begin() + prefix);
+        hash_segments(out, text, prefix, rescanned);
+        out.segment_hashes_.insert(out.segment_hashes_.end(), old.segment_hashes_.begin() + suffix + 1, old.segment_hashes_.end());
+        _src.blob_->analysis_.emplace(std::move(out));
+    }
+
+    // Find the topmost of the layers [0, _end) which defines a name.
+    const source_entry *lookup_layers(std::string_view _name, size_t _end) const {
+        for (size_t i = _end; i-- > 0;) {
+            if (const source_entry *src = layers_[i].find(_name)) { return src; }
+        }
+        return nullptr;
+    }
+
+    // A name resolves to the source added to this glsl_include, or else to the topmost layer which defines it.
+    const source_entry *lookup(std::string_view _name) const {
+        if (const source_entry *src = srcs_.find(_name)) { return src; }
+        return lookup_layers(_name, layers_.size());
+    }
+
+    // Whether a name in a layer is hidden by this glsl_include or by a higher layer.
+    bool shadowed(std::string_view _name, size_t _layer) const {
+        if (srcs_.contains(_name)) { return true; }
+        for (size_t i = _layer + 1; i < layers_.size(); ++i) {
+            if (layers_[i].contains(_name)) { return true; }
+        }
+        return false;
+    }
+
+    // Call _fn(name, source) for every source that a name resolves to.
+    template<typename Fn>
+    void for_each_source(Fn &&_fn) const {
+        srcs_.for_each(_fn);
+        for (size_t i = layers_.size(); i-- > 0;) {
+            layers_[i].for_each([&](const tracked_string &_name, const source_entry &_src) {
+                if (!shadowed(_name, i)) { _fn(_name, _src); }
+            });
+        }
+    }
+
+    // Visit a node in the current merge. Its includes are resolved on its first visit,
+    // so later visits follow them to their nodes without looking up a name or a source.
+    node_scratch &enter(merge_scratch &_scratch, node_scratch &_node) const {
+        if (!_node.analysis_) {
+            _node.analysis_ = &analyse(*_node.src_);
+            _node.first_include_ = static_cast<uint32_t>(_scratch.includes_.size());
+            for (const include_directive &directive : _node.analysis_->directives_) {
+                const source_entry *incl = lookup(directive.name);
+                if (!incl) {
+                    std::string err_msg = "glsl_include - Cannot include missing source " + std::string{directive.name} + ".";
+                    throw std::runtime_error(err_msg);
+                }
+                node_scratch &incl_node = _scratch.nodes_[incl];
+                incl_node.src_ = incl;
+                _scratch.includes_.push_back(&incl_node);
+            }
+            _node.num_includes_ = static_cast<uint32_t>(_node.analysis_->directives_.size());
+        }
+        if (_node.epoch_ != _scratch.epoch_) {
+            _node.epoch_ = _scratch.epoch_;
+            _node.emitted_ = 0;
+            _node.on_path_ = false;
+        }
+        return _node;
+    }
+
+    node_scratch &get_scratch(merge_scratch &_scratch, const source_entry &_src) const {
+        node_scratch &node = _scratch.nodes_[&_src];
+        node.src_ = &_src;
+        return enter(_scratch, node);
+    }
+
+    // Set up the nodes of a merge from a graph whose includes all resolve, so that the merge does not resolve them again.
+    void seed(merge_scratch &_scratch, const source_graph &_graph) const {
+        std::vector<node_scratch *> nodes(_graph.size());
+        _scratch.nodes_.reserve(_graph.size());
+        for (uint32_t i = 0; i < _graph.size(); ++i) {
+            nodes[i] = &_scratch.nodes_[_graph.sources_[i]];
+            nodes[i]->src_ = _graph.sources_[i];
+            nodes[i]->analysis_ = _graph.analyses_[i];
+        }
+        _scratch.includes_.reserve(_scratch.includes_.size() + _graph.targets_.size());
+        for (uint32_t i = 0; i < _graph.size(); ++i) {
+            nodes[i]->first_include_ = static_cast<uint32_t>(_scratch.includes_.size());
+            nodes[i]->num_includes_ = _graph.first_edge_[i + 1] - _graph.first_edge_[i];
+            for (uint32_t edge = _graph.first_edge_[i]; edge < _graph.first_edge_[i + 1]; ++edge) {
+                _scratch.includes_.push_back(nodes[_graph.targets_[edge]]);
             }
         }
-        return in_edges;
     }
 
-    static std::unordered_map<std::string, size_t> get_degrees(const std::unordered_map<std::string, std::string> &_srcs,
-                                                               const std::unordered_map<std::string, std::unordered_set<std::string>> &_edges) {
-        std::unordered_map<std::string, size_t> degrees;
-        for (auto &iter : _srcs) {
-            const auto &name = iter.first;
-            degrees[name] = _edges.contains(name) ? _edges.find(name)->second.size() : 0;
+    node_scratch &include_at(merge_scratch &_scratch, const node_scratch &_node, size_t _index) const {
+        return enter(_scratch, *_scratch.includes_[_node.first_include_ + _index]);
+    }
+
+    void emit(merge_scratch &_scratch, const source_entry &_src, node_scratch &_node) const {
+        _scratch.emitted_.back().push_back(&_src);
+        _node.emitted_ = _scratch.emitted_.back().size();
+    }
+
+    // Copy a known full expansion into the current output, if none of the sources it emits have been emitted yet.
+    bool reuse(merge_scratch &_scratch, const node_scratch &_node) const {
+        for (size_t i = _node.first_; i < _node.first_ + _node.count_; ++i) {
+            if (get_scratch(_scratch, *_scratch.emitted_[_node.output_][i]).emitted_ != 0) { return false; }
+        }
+        for (size_t i = _node.first_; i < _node.first_ + _node.count_; ++i) {
+            const source_entry &src = *_scratch.emitted_[_node.output_][i];
+            emit(_scratch, src, get_scratch(_scratch, src));
         }
-        return degrees;
+        _scratch.outputs_.back()->append(*_scratch.outputs_[_node.output_], _node.begin_, _node.length_);
+        return true;
     }
 
-    // Using toposort, we can ensure that there are no cyclic dependencies, and get the correct order to combine the sources.
-    std::stack<std::string> toposort(std::unordered_map<std::string, std::unordered_set<std::string>> _out_edges,
-                                     std::unordered_map<std::string, size_t> _in_degs) {
-        std::stack<std::string> sorted;
-        std::queue<std::string> topo_queue;
-        for (const auto &iter : _in_degs) {
-            if (iter.second == 0) {
-                topo_queue.push(iter.first);
+    // Each source is emitted once, in place of the first directive that includes it in depth-first order.
+    // Sources are expanded with an explicit stack of frames, so deep chains of includes cannot overflow the call stack.
+    void expand(merge_scratch &_scratch, node_scratch &_root) const {
+        std::string &out = *_scratch.outputs_.back();
+        std::vector<expand_frame> &stack = _scratch.frames_;
+        // One reader is shared by every file source, and only opened when a file source is reached,
+        // so a frame costs the same whether or not its source is in a file.
+        std::optional<chunk_reader> reader;
+        const source_file *reader_file = nullptr;
+        auto append = [&](const expand_frame &_frame, uint64_t _begin, uint64_t _end) {
+            const source_entry &src = *_frame.node_->src_;
+            if (src.blob_->file_ && &*src.blob_->file_ != reader_file) {
+                reader.reset();
+                reader_file = &*src.blob_->file_;
+            }
+            read_text(src, reader, _begin, _end, [&out](std::string_view _piece) { out.append(_piece); });
+        };
+        auto push = [&](node_scratch &_node) {
+            stack.push_back(expand_frame{&_node, 0, 0, out.size(), SIZE_MAX});
+            if (_node.analysis_->leaf()) { return; } // Copying a leaf is as cheap as reusing it, so its expansion is not recorded.
+            _node.on_path_ = true;
+        };
+
+        stack.clear();
+        push(_root);
+        while (!stack.empty()) {
+            expand_frame &top = stack.back();
+            node_scratch &node = *top.node_;
+            if (top.next_ < node.num_includes_) {
+                const include_directive &directive = node.analysis_->directives_[top.next_];
+                node_scratch &incl_node = include_at(_scratch, node, top.next_++);
+                if (incl_node.on_path_) {
+                    throw std::runtime_error("glsl_include - Cyclic dependency detected.");
+                }
+
+                append(top, top.pos_, directive.begin);
+                if (incl_node.emitted_ != 0) {
+                    top.earliest_ = std::min(top.earliest_, incl_node.emitted_);
+                    top.pos_ = directive.erase_end;
+                    continue;
+                }
+                check(_scratch.token_);
+                top.pos_ = directive.splice_end;
+                if (!incl_node.expanded_ || !reuse(_scratch, incl_node)) {
+                    emit(_scratch, *incl_node.src_, incl_node);
+                    push(incl_node); // Invalidates top.
+                }
+                continue;
             }
+
+            append(top, top.pos_, node.src_->size());
+            if (!node.analysis_->leaf()) {
+                node.on_path_ = false;
+                // Nothing emitted before this source was erased, so this is a full expansion.
+                if (!node.expanded_ && top.earliest_ > node.emitted_) {
+                    node.expanded_ = true;
+                    node.output_ = _scratch.outputs_.size() - 1;
+                    node.begin_ = top.begin_;
+                    node.length_ = out.size() - top.begin_;
+                    node.first_ = node.emitted_ - 1;
+                    node.count_ = _scratch.emitted_.back().size() - node.first_;
+                }
+            }
+            const size_t earliest = top.earliest_;
+            stack.pop_back();
+            if (!stack.empty()) { stack.back().earliest_ = std::min(stack.back().earliest_, earliest); }
         }
+    }
 
-        if (topo_queue.size() != 1) {
-            throw std::runtime_error("glsl_include - There must be exactly 1 file which is not included by any other file.");
+    void merge_root(merge_scratch &_scratch, const source_entry &_root) const {
+        check(_scratch.token_);
+        ++_scratch.epoch_;
+        _scratch.outputs_.push_back(std::make_shared<std::string>());
+        _scratch.emitted_.emplace_back();
+        node_scratch &node = get_scratch(_scratch, _root);
+        if (!node.expanded_ || !reuse(_scratch, node)) {
+            emit(_scratch, _root, node);
+            expand(_scratch, node);
+        }
+    }
+
+    // Walks the merge of a root one piece at a time, without assembling it. Each piece is a range of the text of a source,
+    // viewed in place or through the window of its file, and the pieces are in emission order.
+    // The walk follows the same rules as expand(), with an explicit stack instead of recursion, so it can stop after any piece.
+    // Its memory is the stack and the state of the sources it has reached, plus one file window, however long the merge is.
+    class merge_cursor {
+     private:
+        struct frame {
+            node_scratch *node_ = nullptr;
+            uint32_t next_ = 0; // The next directive.
+            uint64_t pos_ = 0, end_ = 0; // The text left to copy before the next directive.
+            std::optional<chunk_reader> reader_{}; // Reads the text of a file source. Closed while an include is walked.
+        };
+
+        const glsl_include *include_;
+        merge_scratch scratch_;
+        std::vector<frame> stack_;
+
+        static uint64_t text_end(const node_scratch &_node, size_t _next) {
+            return _next < _node.num_includes_ ? _node.analysis_->directives_[_next].begin : _node.src_->size();
+        }
+
+        void push(node_scratch &_node) {
+            include_->emit(scratch_, *_node.src_, _node);
+            _node.on_path_ = true;
+            stack_.push_back(frame{&_node, 0, 0, text_end(_node, 0)});
+        }
+
+     public:
+        merge_cursor(const glsl_include &_include, const source_entry &_root, const cancel_token *_token) : include_(&_include) {
+            scratch_.token_ = _token;
+            scratch_.epoch_ = 1;
+            scratch_.emitted_.emplace_back();
+            push(include_->get_scratch(scratch_, _root));
+        }
+
+        bool done() const { return stack_.empty(); }
+
+        // Get the next piece, of at most _max bytes, or an empty view once the merge is done. A piece is valid until the next call.
+        std::string_view next(uint64_t _max = UINT64_MAX) {
+            while (!stack_.empty()) {
+                frame &top = stack_.back();
+                node_scratch &node = *top.node_;
+                if (top.pos_ < top.end_) {
+                    const uint64_t end = top.end_ - top.pos_ > _max ? top.pos_ + std::max<uint64_t>(_max, 1) : top.end_;
+                    std::string_view piece;
+                    if (!node.src_->blob_->file_) {
+                        piece = std::string_view{node.src_->text()}.substr(top.pos_, end - top.pos_);
+                    } else {
+                        if (!top.reader_) { top.reader_.emplace(open(*node.src_->blob_->file_)); }
+                        top.reader_->seek(top.pos_);
+                        piece = top.reader_->read(end);
+                    }
+                    top.pos_ += piece.size();
+                    return piece;
+                }
+                if (top.next_ == node.num_includes_) {
+                    node.on_path_ = false;
+                    stack_.pop_back();
+                    continue;
+                }
+
+                const include_directive &directive = node.analysis_->directives_[top.next_];
+                node_scratch &incl_node = include_->include_at(scratch_, node, top.next_++);
+                if (incl_node.on_path_) {
+                    throw std::runtime_error("glsl_include - Cyclic dependency detected.");
+                }
+                top.end_ = text_end(node, top.next_);
+                if (incl_node.emitted_ != 0) {
+                    top.pos_ = directive.erase_end;
+                    continue;
+                }
+                check(scratch_.token_);
+                top.pos_ = directive.splice_end;
+                top.reader_.reset();
+                push(incl_node); // Invalidates top.
+            }
+            return {};
+        }
+    };
+
+    // Pass the merge of a root to a sink. Pieces are gathered into a buffer of _window bytes, so the sink sees few large writes,
+    // and a piece which does not fit is passed on by itself.
+    template<typename Sink>
+    uint64_t write_merge(const source_entry &_root, const cancel_token *_token, Sink &_sink, size_t _window) const {
+        merge_cursor cursor{*this, _root, _token};
+        std::string buffer;
+        buffer.reserve(_window);
+        uint64_t written = 0;
+        for (std::string_view piece = cursor.next(); !piece.empty(); piece = cursor.next()) {
+            written += piece.size();
+            if (buffer.size() + piece.size() > _window && !buffer.empty()) {
+                _sink(std::string_view{buffer});
+                buffer.clear();
+            }
+            if (piece.size() >= _window) {
+                _sink(piece);
+            } else {
+                buffer.append(piece);
+            }
+        }
+        if (!buffer.empty()) { _sink(std::string_view{buffer}); }
+        return written;
+    }
+
+#ifdef __cpp_lib_generator
+    std::generator<std::string_view> generate_chunks(const source_entry &_root, uint64_t _max_chunk) const {
+        for (std::string_view chunk : chunk_range{*this, _root, _max_chunk}) { co_yield chunk; }
+    }
+#endif
+
+    const source_entry &find(std::string_view _name) const {
+        const source_entry *src = lookup(_name);
+        if (!src) {
+            throw std::runtime_error("glsl_include - Cannot find source " + std::string{_name} + ".");
+        }
+        return *src;
+    }
+
+    uint64_t content_hash(const source_entry &_src) const {
+        await(_src);
+        if (!_src.blob_->content_hash_) {
+            _src.blob_->content_hash_ = hasher::of(_src.text());
+        }
+        return *_src.blob_->content_hash_;
+    }
+
+    // Analyse a source which was added or changed, or queue its analysis, if the policy asks for it.
+    void prepare(const source_entry &_src) {
+        if (_src.blob_->analysis_ && _src.blob_->content_hash_) { return; } // For example, a shared source.
+        if (policy_ == analysis_policy::on_add) {
+            analyse(_src);
+            content_hash(_src);
+        } else if (policy_ == analysis_policy::background) {
+            if (!worker_) { worker_ = std::make_unique<analysis_worker>(); }
+            worker_->push(&_src, [&_src, alloc = allocator<char>(memory_category::metadata)] {
+                if (!_src.blob_->analysis_) { _src.blob_->analysis_.emplace(scan(_src.text(), alloc)); } // Already patched by update().
+                _src.blob_->content_hash_ = hasher::of(_src.text());
+            });
+        }
+    }
+
+    shared_source share(const source_entry &_src) const {
+        analyse(_src);
+        content_hash(_src);
+        return _src.blob_;
+    }
+
+    void put(const std::string &_name, source_entry _src) {
+        if (const source_entry *old = lookup(_name)) {
+            cancel_analysis(*old);
+            cache_invalidate(*old);
+        }
+        prepare(srcs_.insert_or_assign(tracked_string{_name, allocator<char>(memory_category::names)}, std::move(_src)));
+    }
+
+    static uint64_t semantic_hash(const source_entry &_src) {
+        if (!_src.semantic_hash_ && _src.blob_->file_) {
+            semantic_hasher out;
+            line_splitter lines;
+            auto update = [&out](std::string_view _line, uint64_t) { out.update(_line); };
+            read_text(_src, [&](std::string_view _chunk) { lines.feed(_chunk, update); });
+            lines.finish(update);
+            _src.semantic_hash_ = out.digest();
+        } else if (!_src.semantic_hash_) {
+            _src.semantic_hash_ = hasher::semantic(_src.text());
+        }
+        return *_src.semantic_hash_;
+    }
+
+    // Walk the includes reached by a root depth-first, with an explicit stack, so deep chains of includes cannot overflow the call stack.
+    // _enter(node, index, include) is called for each include of a walked node, and returns whether to walk the include.
+    // _leave(node, parent, index) is called once every include of a walked node has been walked. The parent of the root is null.
+    template<typename Enter, typename Leave>
+    void walk(merge_scratch &_scratch, node_scratch &_root, Enter &&_enter, Leave &&_leave) const {
+        std::vector<walk_frame> stack{walk_frame{&_root, 0}};
+        _root.on_path_ = true;
+        while (!stack.empty()) {
+            walk_frame &frame = stack.back();
+            node_scratch &node = *frame.node_;
+            if (frame.next_ < node.num_includes_) {
+                const uint32_t i = frame.next_++;
+                node_scratch &incl_node = include_at(_scratch, node, i);
+                if (incl_node.on_path_) {
+                    throw std::runtime_error("glsl_include - Cyclic dependency detected.");
+                }
+                if (_enter(node, i, incl_node)) {
+                    incl_node.on_path_ = true;
+                    stack.push_back(walk_frame{&incl_node, 0});
+                }
+                continue;
+            }
+            node.on_path_ = false;
+            stack.pop_back();
+            if (stack.empty()) {
+                _leave(node, static_cast<node_scratch *>(nullptr), uint32_t{0});
+            } else {
+                _leave(node, stack.back().node_, stack.back().next_ - 1);
+            }
+        }
+    }
+
+    // Visit the sources reached by a root, in the order that a merge would emit them.
+    template<typename Fn>
+    void visit(merge_scratch &_scratch, node_scratch &_root, Fn &&_fn) const {
+        _root.emitted_ = 1;
+        _fn(*_root.src_);
+        walk(_scratch, _root, [&_fn](const node_scratch &, uint32_t, node_scratch &_incl) {
+            if (_incl.emitted_ != 0) { return false; }
+            _incl.emitted_ = 1;
+            _fn(*_incl.src_);
+            return true;
+        }, [](const node_scratch &, const node_scratch *, uint32_t) {});
+    }
+
+    // Hash what a merge would emit, from the hashes of the segments of each source instead of the bytes.
+    // If two merges have the same hash, their outputs are the same.
+    void hash_expand(merge_scratch &_scratch, node_scratch &_root, hasher &_out) const {
+        walk(_scratch, _root, [&](const node_scratch &_node, uint32_t _index, node_scratch &_incl) {
+            _out.update(_node.analysis_->segment_hashes_[_index]);
+            if (_incl.emitted_ != 0) {
+                _out.update(uint64_t{0});
+                return false;
+            }
+            emit(_scratch, *_incl.src_, _incl);
+            _out.update(uint64_t{1});
+            return true;
+        }, [&_out](const node_scratch &_node, const node_scratch *_parent, uint32_t _index) {
+            _out.update(_node.analysis_->segment_hashes_.back());
+            if (_parent) { _out.update(_parent->analysis_->tail_hashes_[_index]); }
+        });
+    }
+
+    void cache_erase(cache_list::iterator _iter) {
+        for (const source_entry *src : _iter->sources_) {
+            auto dependents = cache_dependents_.find(src);
+            if (dependents == cache_dependents_.end()) { continue; }
+            dependents->second.erase(_iter->root_);
+            if (dependents->second.empty()) { cache_dependents_.erase(dependents); }
+        }
+        cache_stats_.bytes -= _iter->bytes_;
+        counters_->sub(memory_category::caches, _iter->output_->capacity());
+        cache_index_.erase(_iter->root_);
+        cache_.erase(_iter);
+    }
+
+    // Drop the cached outputs of every root which reaches a source.
+    void cache_invalidate(const source_entry &_src) {
+        auto dependents = cache_dependents_.find(&_src);
+        if (dependents == cache_dependents_.end()) { return; }
+        const root_set roots = std::move(dependents->second);
+        cache_dependents_.erase(dependents);
+        for (const auto &root : roots) {
+            auto iter = cache_index_.find(root);
+            if (iter == cache_index_.end()) { continue; }
+            ++cache_stats_.invalidations;
+            cache_erase(iter->second);
+        }
+    }
+
+    output_ptr cache_find(const std::string &_root) {
+        if (cache_budget_ == 0) { return nullptr; }
+        auto iter = cache_index_.find(_root);
+        if (iter == cache_index_.end()) {
+            ++cache_stats_.misses;
+            return nullptr;
+        }
+        ++cache_stats_.hits;
+        cache_.splice(cache_.begin(), cache_, iter->second);
+        return iter->second->output_;
+    }
+
+    // The cache keeps a share of the output, and counts its bytes for as long as it does.
+    void cache_insert(const std::string &_root, output_ptr _output, const std::vector<const source_entry *> &_sources) {
+        const size_t bytes = _root.size() + _output->size() + _sources.size() * sizeof(const source_entry *);
+        if (bytes > cache_budget_) { return; }
+        while (cache_stats_.bytes + bytes > cache_budget_) {
+            ++cache_stats_.evictions;
+            cache_erase(std::prev(cache_.end()));
+        }
+
+        const auto alloc = allocator<char>(memory_category::caches);
+        counters_->add(memory_category::caches, _output->capacity());
+        cache_.push_front(cache_entry{tracked_string{_root, alloc}, std::move(_output),
+                                      tracked_vector<const source_entry *>(_sources.begin(), _sources.end(), alloc), bytes});
+        cache_index_.insert_or_assign(tracked_string{_root, alloc}, cache_.begin());
+        for (const source_entry *src : _sources) {
+            cache_dependents_.try_emplace(src, alloc).first->second.emplace(_root, alloc);
+        }
+        cache_stats_.bytes += bytes;
+    }
+
+    // An output is never changed once its merge is done, so it can be shared while later merges of the batch copy from it.
+    std::vector<output_ptr> merge_roots(const std::vector<std::string> &_roots, const cancel_token *_token) {
+        merge_scratch scratch;
+        scratch.token_ = _token;
+        scratch.outputs_.reserve(_roots.size());
+        scratch.emitted_.reserve(_roots.size());
+        std::vector<output_ptr> out;
+        out.reserve(_roots.size());
+        for (const auto &root : _roots) {
+            if (output_ptr cached = cache_find(root)) {
+                out.push_back(std::move(cached));
+                scratch.outputs_.emplace_back();
+                scratch.emitted_.emplace_back();
+                continue;
+            }
+            merge_root(scratch, find(root));
+            out.push_back(scratch.outputs_.back());
+            if (cache_budget_ != 0) {
+                cache_insert(root, out.back(), scratch.emitted_.back());
+            }
+        }
+        return out;
+    }
+
+    // Take the bytes of an output, without copying them if nothing else shares it.
+    static std::string take(output_ptr _output) {
+        if (_output.use_count() == 1) {
+            return std::move(const_cast<std::string &>(*_output)); // Every output is created as a non-const std::string.
+        }
+        return *_output;
+    }
+
+    static std::vector<std::string> take(std::vector<output_ptr> _outputs) {
+        std::vector<std::string> out;
+        out.reserve(_outputs.size());
+        for (output_ptr &output : _outputs) { out.push_back(take(std::move(output))); }
+        return out;
+    }
+
+    // Run _fn(i) for every i in [0, _n), spread over worker threads when there is enough work.
+    template<typename Fn>
+    static void parallel_for(size_t _n, Fn &&_fn) {
+        constexpr size_t min_per_worker = 16;
+        const size_t workers = std::min<size_t>(_n / min_per_worker, std::max(1u, std::thread::hardware_concurrency()));
+        if (workers <= 1) {
+            for (size_t i = 0; i < _n; ++i) { _fn(i); }
+            return;
+        }
+        std::vector<std::future<void>> futures;
+        futures.reserve(workers);
+        for (size_t w = 0; w < workers; ++w) {
+            futures.push_back(std::async(std::launch::async, [&_fn, _n, w, workers] {
+                for (size_t i = w; i < _n; i += workers) { _fn(i); }
+            }));
+        }
+        for (auto &future : futures) { future.get(); }
+    }
+
+    using staged_map = std::map<std::string, std::optional<std::string>, std::less<>>;
+
+    // Scan the staged sources, validate the graph they make with the unchanged sources, then apply them.
+    // Nothing is applied unless the whole graph is valid.
+    void apply(const staged_map &_staged) {
+        std::vector<source_entry> added;
+        std::unordered_map<std::string_view, const source_entry *> changed; // nullptr for removed sources.
+        added.reserve(_staged.size());
+        for (const auto &[name, source] : _staged) {
+            if (source) { added.push_back(make_entry(*source)); }
+        }
+        parallel_for(added.size(), [&](size_t _i) {
+            analyse(added[_i]);
+            if (policy_ == analysis_policy::on_add) { content_hash(added[_i]); }
+        });
+        size_t next = 0;
+        for (const auto &[name, source] : _staged) {
+            changed.emplace(name, source ? &added[next++] : nullptr);
+        }
+
+        // Removing a source reveals the source with the same name in the layers, if there is one.
+        auto lookup = [&](std::string_view _name) -> const source_entry * {
+            if (auto iter = changed.find(_name); iter != changed.end()) { return iter->second ? iter->second : lookup_layers(_name, layers_.size()); }
+            return this->lookup(_name);
+        };
+        auto missing = [](std::string_view _name) {
+            return std::runtime_error("glsl_include - Cannot include missing source " + std::string{_name} + ".");
+        };
+
+        // Only changed sources can include a missing source, unless a source was removed.
+        // Unchanged sources are only checked for includes of the removed names, so sources which were already broken do not block the transaction.
+        for (const source_entry &src : added) {
+            for (const include_directive &directive : src.blob_->analysis_->directives_) {
+                if (!lookup(directive.name)) { throw missing(directive.name); }
+            }
+        }
+        const bool removes = std::any_of(changed.begin(), changed.end(), [](const auto &_iter) { return _iter.second == nullptr; });
+        if (removes) {
+            for_each_source([&](const tracked_string &_name, const source_entry &_src) {
+                if (changed.contains(std::string_view{_name})) { return; }
+                for (const include_directive &directive : analyse(_src).directives_) {
+                    if (changed.contains(directive.name) && !lookup(directive.name)) { throw missing(directive.name); }
+                }
+            });
         }
 
-        while (!topo_queue.empty()) {
-            const std::string& from = topo_queue.front();
-            sorted.push(from);
-            for (const auto &to : _out_edges[from]) {
-                if (--_in_degs[to] == 0) {
-                    topo_queue.push(to);
+        // Every new cycle passes through a changed source, or a source revealed by a removal.
+        // The walk can reach unchanged sources whose includes were already missing, which are rejected too.
+        struct cycle_frame {
+            const source_entry *src_ = nullptr;
+            const source_analysis *analysis_ = nullptr;
+            size_t next_ = 0; // The next directive.
+        };
+        std::unordered_map<const source_entry *, bool /* On path */> visited;
+        std::vector<cycle_frame> stack;
+        for (const auto &[name, src] : changed) {
+            const source_entry *visible = lookup(name);
+            if (!visible || visited.contains(visible)) { continue; }
+            visited.emplace(visible, true);
+            stack.push_back(cycle_frame{visible, &analyse(*visible), 0});
+            while (!stack.empty()) {
+                cycle_frame &frame = stack.back();
+                if (frame.next_ == frame.analysis_->directives_.size()) {
+                    visited[frame.src_] = false;
+                    stack.pop_back();
+                    continue;
+                }
+                const std::string_view incl_name = frame.analysis_->directives_[frame.next_++].name;
+                const source_entry *incl = lookup(incl_name);
+                if (!incl) { throw missing(incl_name); }
+                auto [iter, inserted] = visited.emplace(incl, true);
+                if (inserted) {
+                    stack.push_back(cycle_frame{incl, &analyse(*incl), 0});
+                } else if (iter->second) {
+                    throw std::runtime_error("glsl_include - Cyclic dependency detected.");
                 }
             }
-            topo_queue.pop(); // Pop at the end, because from is a reference.
         }
 
-        for (auto &iter : _in_degs) {
-            if (iter.second != 0) {
-                throw std::runtime_error("glsl_include - Cyclic dependency detected.");
+        // Drop every cached output which reaches a changed source, then apply the changes.
+        for (const auto &[name, source] : _staged) {
+            if (const source_entry *old = this->lookup(name)) {
+                cancel_analysis(*old);
+                cache_invalidate(*old);
+            }
+        }
+        next = 0;
+        for (const auto &[name, source] : _staged) {
+            if (!source) {
+                srcs_.erase(std::string_view{name});
+                if (auto output = outputs_.find(std::string_view{name}); output != outputs_.end()) { outputs_.erase(output); }
+            } else {
+                srcs_.insert_or_assign(tracked_string{name, allocator<char>(memory_category::names)}, std::move(added[next++]));
             }
         }
+    }
+
+    using name_set = std::unordered_set<std::string, string_hash, string_equal>;
 
-        return sorted;
+    // Find the roots which reach a source that includes one of _removed, where that name no longer resolves.
+    // One pass over the sources builds the graph, and a search up its reversed edges from the broken includes finds the roots.
+    std::vector<std::string> broken_roots(const name_set &_removed) const {
+        std::vector<uint32_t> pending;
+        const source_graph graph = build_graph(nullptr, [&](uint32_t _node, std::string_view _name) {
+            if (_removed.contains(_name) && (pending.empty() || pending.back() != _node)) { pending.push_back(_node); }
+        });
+        const auto [first_edge, targets] = graph.reversed();
+
+        std::vector<bool> visited(graph.size(), false);
+        for (uint32_t node : pending) { visited[node] = true; }
+        std::vector<std::string> roots;
+        while (!pending.empty()) {
+            const uint32_t node = pending.back();
+            pending.pop_back();
+            if (graph.in_degrees_[node] == 0) { roots.emplace_back(graph.names_[node]); }
+            for (uint32_t edge = first_edge[node]; edge < first_edge[node + 1]; ++edge) {
+                if (!visited[targets[edge]]) {
+                    visited[targets[edge]] = true;
+                    pending.push_back(targets[edge]);
+                }
+            }
+        }
+        std::sort(roots.begin(), roots.end());
+        return roots;
+    }
+
+    std::string merge_all(const cancel_token *_token) {
+        const source_graph graph = build_graph(_token, [](uint32_t, std::string_view _name) {
+            throw std::runtime_error("glsl_include - Cannot include missing source " + std::string{_name} + ".");
+        });
+        check(_token);
+        const uint32_t root = toposort(graph); // Throws if there is not exactly 1 root, or if there is a cyclic dependency.
+
+        merge_scratch scratch;
+        scratch.token_ = _token;
+        seed(scratch, graph);
+        merge_root(scratch, *graph.sources_[root]);
+        return std::move(*scratch.outputs_.back());
     }
 
  public:
+    /**
+     * Stages additions, replacements and removals of sources, and applies them together.
+     * Only the staged sources are scanned, the graph is validated once, and cached outputs are invalidated in one pass.
+     */
+    class transaction {
+     private:
+        friend class glsl_include;
+
+        glsl_include &include_;
+        staged_map staged_;
+
+        explicit transaction(glsl_include &_include) : include_(_include) {}
+
+     public:
+        ~transaction() = default;
+
+        /**
+         * Stage the addition of a source, or the replacement of a source with the same name.
+         * @param _name The name of the source.
+         * @param _source The actual contents of your shader.
+         */
+        void add(const std::string &_name, std::string _source) {
+            staged_.insert_or_assign(_name, std::move(_source));
+        }
+
+        /**
+         * Stage the removal of a source.
+         * @param _name The name of the source.
+         */
+        void remove(const std::string &_name) {
+            staged_.insert_or_assign(_name, std::nullopt);
+        }
+
+        /**
+         * @return The number of staged changes.
+         */
+        size_t size() const { return staged_.size(); }
+
+        /**
+         * Apply every staged change at once. The staged sources are scanned in parallel.
+         * If the resulting sources would include a missing source or have a cyclic dependency,
+         * nothing is applied, and the staged changes are kept so they can be fixed and committed again.
+         * Replaced sources keep their remerge records, so remerge() can tell whether their roots changed.
+         * @throws std::runtime_error If the resulting sources are invalid.
+         */
+        void commit() {
+            include_.apply(staged_);
+            staged_.clear();
+        }
+    };
+
+    /**
+     * A merge of a root which is done a slice at a time, such as within the frame budget of a render thread, without a thread of its own.
+     * Each step copies pieces of the merged source until its time budget runs out, and the walk resumes where it stopped on the next step.
+     * A step may overrun its budget by the time to scan a source which the merge reaches for the first time,
+     * so analyse sources on add or in the background to keep steps short. See set_analysis_policy().
+     * The glsl_include must outlive the merge, and its sources must not be changed until the merge is done.
+     */
+    class incremental_merge {
+     private:
+        friend class glsl_include;
+
+        merge_cursor cursor_;
+        std::string output_;
+
+        incremental_merge(const glsl_include &_include, const source_entry &_root) : cursor_(_include, _root, nullptr) {}
+
+     public:
+        ~incremental_merge() = default;
+
+        /**
+         * Continue the merge for up to a time budget. At least one piece is copied, so every step makes progress.
+         * @param _budget_us The time budget, in microseconds.
+         * @return Whether the merge is done.
+         * @throws std::runtime_error If the merge reaches a missing source or a cyclic dependency.
+         */
+        bool step(uint64_t _budget_us) {
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds{_budget_us};
+            do {
+                const std::string_view piece = cursor_.next(default_chunk_size); // Bounds the time to copy a piece.
+                if (piece.empty()) { break; }
+                output_.append(piece);
+            } while (std::chrono::steady_clock::now() < deadline);
+            return cursor_.done();
+        }
+
+        /**
+         * @return Whether the merge is done.
+         */
+        bool done() const { return cursor_.done(); }
+
+        /**
+         * @return The merged source so far, which is complete once the merge is done.
+         */
+        const std::string &output() const { return output_; }
+
+        /**
+         * Take the merged source so far, leaving the output empty.
+         * @return The merged source.
+         */
+        std::string take() { return std::exchange(output_, {}); }
+    };
+
+    /**
+     * The merged source of a root as a lazy sequence of chunks, in emission order. Each chunk is copied from a source only when
+     * the sequence is advanced to it, so consumers such as a hash, a compressor or a socket can pull the merge without it being assembled.
+     * It is a single-pass input range: a chunk is valid until the range is advanced, and iterating it again continues where it stopped.
+     * The glsl_include must outlive the range, and its sources must not be changed until the range is done.
+     */
+    class chunk_range {
+     private:
+        friend class glsl_include;
+
+        const glsl_include *include_;
+        const source_entry *root_;
+        std::optional<merge_cursor> cursor_; // Built by the first begin(), so that nothing is analysed until the chunks are pulled.
+        uint64_t max_chunk_;
+        std::string_view chunk_;
+
+        chunk_range(const glsl_include &_include, const source_entry &_root, uint64_t _max_chunk)
+            : include_(&_include), root_(&_root), max_chunk_(_max_chunk) {}
+
+        void advance() { chunk_ = cursor_->next(max_chunk_); }
+
+     public:
+        class iterator {
+         private:
+            chunk_range *range_ = nullptr;
+
+         public:
+            using value_type = std::string_view;
+            using difference_type = std::ptrdiff_t;
+
+            iterator() = default;
+
+            explicit iterator(chunk_range &_range) : range_(&_range) {}
+
+            std::string_view operator*() const { return range_->chunk_; }
+
+            iterator &operator++() {
+                range_->advance();
+                return *this;
+            }
+
+            void operator++(int) { ++*this; }
+
+            bool operator==(std::default_sentinel_t) const { return range_->chunk_.empty(); }
+        };
+
+        ~chunk_range() = default;
+
+        /**
+         * Get the current chunk, copying the first chunk if the range has not been started.
+         * @throws std::runtime_error If the merge reaches a missing source or a cyclic dependency.
+         */
+        iterator begin() {
+            if (!cursor_) {
+                cursor_.emplace(*include_, *root_, nullptr);
+                advance();
+            }
+            return iterator{*this};
+        }
+
+        std::default_sentinel_t end() const { return {}; }
+    };
+
+#ifdef __cpp_lib_generator
+    using chunk_sequence = std::generator<std::string_view>;
+#else
+    using chunk_sequence = chunk_range; // std::generator is not available, so the chunks come from a range with the same interface.
+#endif
+
     glsl_include() = default;
 
-    ~glsl_include() = default;
+    /**
+     * Fork another glsl_include. The index of sources is shared in O(1), whatever the number of sources,
+     * and each glsl_include copies only the parts of it that it changes later. See fork().
+     * The cached outputs are shared rather than copied, so the copy is served them until it changes a source they reach.
+     * Shared sources and names keep being counted in the memory usage of the glsl_include which created them.
+     * The remerge records are copied.
+     */
+    glsl_include(const glsl_include &_other)
+        : srcs_(_other.srcs_, allocator<char>(memory_category::graph)), cache_budget_(_other.cache_budget_), policy_(_other.policy_) {
+        if (_other.worker_) { _other.worker_->await_all(); } // The copy must not see the analysis of a shared source half-written.
+        for (const source_map &layer : _other.layers_) {
+            layers_.emplace_back(layer, allocator<char>(memory_category::graph));
+        }
+        for (const auto &[root, record] : _other.outputs_) {
+            outputs_.try_emplace(tracked_string{root, allocator<char>(memory_category::names)}, record);
+        }
+        for (auto iter = _other.cache_.rbegin(); iter != _other.cache_.rend(); ++iter) {
+            cache_insert(std::string{iter->root_}, iter->output_, std::vector<const source_entry *>(iter->sources_.begin(), iter->sources_.end()));
+        }
+    }
+
+    glsl_include(glsl_include &&) = default;
+
+    ~glsl_include() {
+        worker_.reset(); // The worker may be analysing a source, so stop it first.
+    }
+
+    glsl_include &operator=(const glsl_include &_other) {
+        if (this != &_other) { *this = glsl_include{_other}; }
+        return *this;
+    }
+
+    glsl_include &operator=(glsl_include &&) = default;
+
+    /**
+     * Fork this glsl_include in O(1), to override a few of its sources without copying the rest.
+     * The fork shares the sources, their analyses and the cached outputs of this glsl_include.
+     * Adding, updating or removing a source in either one copies only the path to that source in the index,
+     * and drops only the cached outputs which reach it, so the fork's other roots are still served from the cache.
+     * Both share data which is computed on first use, such as line tables, so they must not be used from different threads at the same time.
+     * @return The fork.
+     */
+    glsl_include fork() const {
+        return glsl_include{*this};
+    }
 
     /**
      * Add a source. The content of the source will be used to replace wherever the #include directive is used.
      * For example, if the source name is `abc.frag`, use `#include <abc.frag>` in another source to include this.
+     * If a source with the same name exists, it is replaced, and the cached outputs which reach it are dropped.
      * @param _name The name of the source.
      * @param _source The actual contents of your shader.
      */
     void add(const std::string &_name, const std::string &_source) {
-        srcs_.insert({_name, _source});
+        put(_name, make_entry(_source));
+    }
+
+    /**
+     * Add a source whose text stays in a file, such as a large generated table, so that it is never held in memory whole.
+     * The file is scanned and hashed now, one chunk at a time, and merges read the parts of it that they copy.
+     * The memory used to scan or copy it is bounded by the chunk size and its longest line.
+     * The file must not change while the source is added, so add it again after changing it. Updating the source loads it into memory.
+     * If a source with the same name exists, it is replaced.
+     * @param _name The name of the source.
+     * @param _path The path of the file.
+     * @param _chunk_size The most bytes read from the file at a time.
+     * @throws std::runtime_error If the file cannot be read.
+     */
+    void add_file(const std::string &_name, const std::filesystem::path &_path, size_t _chunk_size = default_chunk_size) {
+        source_entry src = make_entry({});
+        src.blob_->file_.emplace(source_file{tracked_string{_path.string(), allocator<char>(memory_category::sources)}, 0, _chunk_size,
+                                             tracked_string{allocator<char>(memory_category::metadata)}});
+        scan_file(*src.blob_, allocator<char>(memory_category::metadata));
+        put(_name, std::move(src));
+    }
+
+    /**
+     * Add a source which is shared with another glsl_include. Only a reference count is taken, and nothing is copied or scanned.
+     * If a source with the same name exists, it is replaced.
+     * @param _name The name of the source.
+     * @param _source The shared source, from share().
+     */
+    void add(const std::string &_name, shared_source _source) {
+        // A blob is created non-const, and a shared blob is copied before it is changed.
+        put(_name, source_entry{std::const_pointer_cast<source_blob>(std::move(_source))});
     }
 
     /**
-     * Remove a source.
+     * Share a source with other glsl_includes. The source is analysed first, if it has not been already.
+     * If either glsl_include later updates the source, it gets a copy of its own first.
+     * @param _name The name of the source.
+     * @return The shared source.
+     */
+    shared_source share(const std::string &_name) const {
+        return share(find(_name));
+    }
+
+    /**
+     * Patch the text of a source in place, replacing [_offset, _offset + _erase) with _insert.
+     * Only the lines touched by the patch are scanned for include directives again.
+     * The cached outputs which reach the source are dropped.
+     * @param _name The name of the source.
+     * @param _offset The byte offset of the patch.
+     * @param _erase The number of bytes to erase. Clamped to the end of the source.
+     * @param _insert The bytes to insert.
+     */
+    void update(const std::string &_name, size_t _offset, size_t _erase, std::string_view _insert) {
+        const source_entry &old = find(_name);
+        if (_offset > old.size()) {
+            throw std::runtime_error("glsl_include - Cannot update source " + _name + " past its end.");
+        }
+        cancel_analysis(old);
+        cache_invalidate(old);
+        if (!srcs_.contains(std::string_view{_name})) { // Override a source of a layer, which stays unchanged.
+            srcs_.insert_or_assign(tracked_string{_name, allocator<char>(memory_category::names)}, old);
+        }
+        source_entry &src = *srcs_.find_mutable(std::string_view{_name}); // A copy of the entry, if it is shared with a fork.
+        unshare(src);
+        patch(src, _offset, std::min(_erase, src.text().size() - _offset), _insert);
+        src.lines_.reset();
+        src.semantic_hash_.reset();
+        src.blob_->content_hash_.reset();
+        prepare(src);
+    }
+
+    /**
+     * Start staging changes to apply together. The transaction must not outlive this glsl_include.
+     * @return An empty transaction.
+     */
+    transaction begin_update() {
+        return transaction{*this};
+    }
+
+    /**
+     * Remove a source. If a layer defines a source with the same name, that source is used again.
+     * The sources of layers cannot be removed, only overridden.
      * @param _name The name of the source.
      */
     void remove(const std::string &_name) {
-        auto iter = srcs_.find(_name);
-        if (iter != srcs_.end()) {
-            srcs_.erase(iter);
+        if (const source_entry *src = srcs_.find(std::string_view{_name})) {
+            cancel_analysis(*src);
+            cache_invalidate(*src);
+            srcs_.erase(std::string_view{_name});
+        }
+        if (auto output = outputs_.find(std::string_view{_name}); output != outputs_.end()) {
+            outputs_.erase(output);
+        }
+    }
+
+    /**
+     * Remove every source whose name satisfies a predicate, and find the remaining roots which no longer merge because of it.
+     * The cached outputs are invalidated and the graph is checked once for the whole batch.
+     * As with remove(), the sources of layers are not removed.
+     * @param _pred Called with the name of each source added to this glsl_include. Returns whether to remove it.
+     * @return The remaining roots which reach an include of a removed source, sorted by name.
+     */
+    template<typename Pred>
+    std::vector<std::string> remove_if(Pred &&_pred) {
+        name_set removed;
+        srcs_.for_each([&](const tracked_string &_name, const source_entry &) {
+            if (_pred(std::string_view{_name})) { removed.emplace(_name); }
+        });
+        for (const std::string &name : removed) {
+            const source_entry &src = *srcs_.find(name);
+            cancel_analysis(src);
+            cache_invalidate(src);
+            srcs_.erase(name);
+            if (auto output = outputs_.find(std::string_view{name}); output != outputs_.end()) { outputs_.erase(output); }
         }
+        return removed.empty() ? std::vector<std::string>{} : broken_roots(removed);
+    }
+
+    /**
+     * Remove every source whose name starts with a prefix, such as the sources of an unloaded mod.
+     * @param _prefix The prefix of the names to remove.
+     * @return The remaining roots which reach an include of a removed source, sorted by name.
+     */
+    std::vector<std::string> remove_prefix(std::string_view _prefix) {
+        return remove_if([_prefix](std::string_view _name) { return _name.starts_with(_prefix); });
     }
 
     /**
      * Remove all sources.
      */
     void clear() {
+        if (worker_) { worker_->cancel_all(); }
+        while (!cache_.empty()) { cache_erase(cache_.begin()); }
         srcs_.clear();
+        layers_.clear();
+        outputs_.clear();
+    }
+
+    /**
+     * Set a layer of sources underneath the sources added to this glsl_include, sharing the sources of another glsl_include in O(1).
+     * A name resolves to the source added to this glsl_include, or else to the topmost layer which defines it.
+     * Layers are numbered from the bottom up, so a project layer above an engine layer has the higher index.
+     * Setting a layer again compares it with its last state, skipping whatever the two share, and only drops the cached outputs
+     * which reach a source whose name now resolves differently. The layer is a snapshot, and later changes to _layer are only
+     * seen when the layer is set again. Only the sources added to _layer itself are shared, and not those of its own layers.
+     * @param _index The index of the layer. Missing layers below it are added empty.
+     * @param _layer The glsl_include whose sources make up the layer.
+     */
+    void set_layer(size_t _index, const glsl_include &_layer) {
+        if (_layer.worker_) { _layer.worker_->await_all(); }
+        if (_index >= layers_.size()) {
+            layers_.resize(_index + 1, source_map{allocator<char>(memory_category::graph)});
+        }
+        const source_map old = layers_[_index]; // Keeps the replaced sources alive until their cached outputs are dropped.
+        layers_[_index] = source_map{_layer.srcs_, allocator<char>(memory_category::graph)};
+        source_map::diff(old, layers_[_index], [&](const tracked_string &_name, const source_entry *_old, const source_entry *) {
+            if (shadowed(_name, _index)) { return; }
+            if (const source_entry *visible = _old ? _old : lookup_layers(_name, _index)) { cache_invalidate(*visible); }
+        });
+    }
+
+    /**
+     * @return The number of layers.
+     */
+    size_t num_layers() const { return layers_.size(); }
+
+    /**
+     * Get the line table of a source, which converts between byte offsets and line numbers.
+     * The table is built the first time it is needed, and kept until the source is removed.
+     * @param _name The name of the source.
+     * @return The line table of the source.
+     */
+    const line_table_type &lines(const std::string &_name) const {
+        const source_entry &src = find(_name);
+        if (!src.lines_ && src.blob_->file_) {
+            src.lines_.emplace(allocator<uint32_t>(memory_category::metadata));
+            read_text(src, [&](std::string_view _chunk) { src.lines_->append(_chunk); });
+        } else if (!src.lines_) {
+            src.lines_.emplace(src.text(), allocator<uint32_t>(memory_category::metadata));
+        }
+        return *src.lines_;
+    }
+
+    /**
+     * Set when sources are analysed. Changing the policy does not analyse the sources which are already added.
+     * @param _policy The analysis policy. analysis_policy::on_merge by default.
+     */
+    void set_analysis_policy(analysis_policy _policy) {
+        policy_ = _policy;
+    }
+
+    /**
+     * Get the hash of the bytes of a source.
+     * The hash is computed when the source is added if the analysis policy is analysis_policy::on_add, or else the first time it is needed.
+     * @param _name The name of the source.
+     * @return The hash of the source.
+     */
+    uint64_t content_hash(const std::string &_name) const {
+        return content_hash(find(_name));
+    }
+
+    /**
+     * Get the semantic hash of a source, which ignores comments and insignificant whitespace.
+     * The hash is computed the first time it is needed, and kept until the source is removed.
+     * @param _name The name of the source.
+     * @return The semantic hash of the source.
+     */
+    uint64_t semantic_hash(const std::string &_name) const {
+        return semantic_hash(find(_name));
+    }
+
+    /**
+     * Get the fingerprint of a root, which combines the semantic hashes of every source it reaches, in emission order.
+     * If the fingerprint has not changed, the root's merged source has only changed in comments or whitespace,
+     * so there is no need to recompile it.
+     * @param _root The name of the root source.
+     * @return The fingerprint of the root.
+     */
+    uint64_t fingerprint(const std::string &_root) const {
+        const source_entry &root = find(_root);
+        merge_scratch scratch;
+        scratch.epoch_ = 1;
+        hasher out;
+        visit(scratch, get_scratch(scratch, root), [&out](const source_entry &_src) {
+            out.update(semantic_hash(_src));
+        });
+        return out.digest();
     }
 
     /**
@@ -155,41 +1722,241 @@ class glsl_include {
      * @return The merger of all the sources added.
      */
     std::string merge() {
-        auto out_edges = get_out_edges(srcs_);
-        auto in_edges = get_in_edges(out_edges);
-        auto out_degrees = get_degrees(srcs_, out_edges);
-        auto in_degrees = get_degrees(srcs_, in_edges);
-        auto sorted = toposort(out_edges, in_degrees);
+        return merge_all(nullptr);
+    }
 
-        // Replace includes.
-        std::unordered_map<std::string, bool> visited;
-        std::unordered_map<std::string, std::string> modified;
-        std::string source;
-        while (!sorted.empty()) {
-            const std::string& name = sorted.top();
-            source = srcs_[name];
+    /**
+     * Merge all added sources into a one.
+     * @param _token Cancels the merge.
+     * @return The merger of all the sources added.
+     * @throws merge_cancelled If the merge was cancelled.
+     */
+    std::string merge(const cancel_token &_token) {
+        return merge_all(&_token);
+    }
 
-            const auto &included = out_edges[name];
-            for (const std::string &incl : included) {
-                if (visited[incl]) { continue; }
-                visited[incl] = true;
-                std::regex spec(R"(^[\s]*#include[\s]+<)" + incl + R"(>)", std::regex::ECMAScript | std::regex::multiline);
-                source = std::regex_replace(source, spec, modified[incl], std::regex_constants::format_first_only);
-            }
+    /**
+     * Merge a root and every source it includes. Sources which the root does not reach are ignored.
+     * Each source is only included once, in place of the first `#include` that reaches it in depth-first order.
+     * @param _root The name of the root source.
+     * @return The merged source.
+     */
+    std::string merge(const std::string &_root) {
+        return take(std::move(merge_roots({_root}, nullptr).back()));
+    }
+
+    /**
+     * Merge a root and every source it includes.
+     * @param _root The name of the root source.
+     * @param _token Cancels the merge.
+     * @return The merged source.
+     * @throws merge_cancelled If the merge was cancelled.
+     */
+    std::string merge(const std::string &_root, const cancel_token &_token) {
+        return take(std::move(merge_roots({_root}, &_token).back()));
+    }
 
-            // Delete duplicate lines of `#include <XXX>`.
-            for (const std::string &incl : included) {
-                std::regex spec(R"(^[\s]*#include[\s]+<)" + incl + R"(>[\s\r\n]*)", std::regex::ECMAScript | std::regex::multiline);
-                source = std::regex_replace(source, spec, "");
+    /**
+     * Merge a root into an immutable buffer, which can be handed to many consumers without copying.
+     * An output served from the cache is the cached buffer itself.
+     * @param _root The name of the root source.
+     * @return The merged source.
+     */
+    output_ptr merge_shared(const std::string &_root) {
+        return std::move(merge_roots({_root}, nullptr).back());
+    }
+
+    /**
+     * Merge a root into an immutable buffer.
+     * @param _root The name of the root source.
+     * @param _token Cancels the merge.
+     * @return The merged source.
+     * @throws merge_cancelled If the merge was cancelled.
+     */
+    output_ptr merge_shared(const std::string &_root, const cancel_token &_token) {
+        return std::move(merge_roots({_root}, &_token).back());
+    }
+
+    /**
+     * Merge a root straight into a sink, without holding the merged source in memory.
+     * The merge is walked in emission order, and the text of each source is passed on as it is reached,
+     * read through a window of its file for sources added with add_file(). Only the state of each source the root reaches is kept,
+     * plus one buffer of _window bytes, so many merges can run side by side in a fixed amount of memory.
+     * The cache of merged outputs is neither used nor filled. Sources must not be changed until the merge returns.
+     * @param _root The name of the root source.
+     * @param _sink Called with each piece of the merged source, in order. A piece is only valid during the call.
+     * @param _window Pieces are gathered until they reach this many bytes before they are passed on.
+     * @return The length of the merged source.
+     */
+    template<typename Sink> requires std::invocable<Sink &, std::string_view>
+    uint64_t merge_to(const std::string &_root, Sink &&_sink, size_t _window = default_chunk_size) const {
+        return write_merge(find(_root), nullptr, _sink, _window);
+    }
+
+    /**
+     * Merge a root straight into a sink.
+     * @param _root The name of the root source.
+     * @param _sink Called with each piece of the merged source, in order.
+     * @param _token Cancels the merge. The pieces already passed on are not taken back.
+     * @param _window Pieces are gathered until they reach this many bytes before they are passed on.
+     * @return The length of the merged source.
+     * @throws merge_cancelled If the merge was cancelled.
+     */
+    template<typename Sink> requires std::invocable<Sink &, std::string_view>
+    uint64_t merge_to(const std::string &_root, Sink &&_sink, const cancel_token &_token, size_t _window = default_chunk_size) const {
+        return write_merge(find(_root), &_token, _sink, _window);
+    }
+
+    /**
+     * Merge a root straight into a stream.
+     * @param _root The name of the root source.
+     * @param _out The stream to write to.
+     * @param _window The bytes gathered before each write.
+     * @return The length of the merged source.
+     * @throws std::runtime_error If the stream fails.
+     */
+    uint64_t merge_to(const std::string &_root, std::ostream &_out, size_t _window = default_chunk_size) const {
+        return merge_to(_root, [&_out](std::string_view _piece) {
+            if (!_out.write(_piece.data(), static_cast<std::streamsize>(_piece.size()))) {
+                throw std::runtime_error("glsl_include - Cannot write merged source.");
             }
+        }, _window);
+    }
+
+    /**
+     * Merge a root straight into a file, which is replaced.
+     * @param _root The name of the root source.
+     * @param _path The path of the file.
+     * @param _window The bytes gathered before each write.
+     * @return The length of the merged source.
+     * @throws std::runtime_error If the file cannot be written.
+     */
+    uint64_t merge_to(const std::string &_root, const std::filesystem::path &_path, size_t _window = default_chunk_size) const {
+        std::ofstream out{_path, std::ios::binary};
+        if (!out) {
+            throw std::runtime_error("glsl_include - Cannot open file " + _path.string() + ".");
+        }
+        return merge_to(_root, static_cast<std::ostream &>(out), _window);
+    }
+
+    /**
+     * Start a merge of a root which is done a slice at a time by incremental_merge::step().
+     * Like merge_to(), it does not use or fill the cache of merged outputs.
+     * @param _root The name of the root source.
+     * @return The merge, which has not done any work yet.
+     */
+    incremental_merge begin_merge(const std::string &_root) const {
+        return incremental_merge{*this, find(_root)};
+    }
+
+    /**
+     * Get the merged source of a root as a lazy sequence of chunks, in emission order.
+     * Only the root is looked up here. Its sources are analysed and their includes resolved as the chunks are pulled,
+     * so a missing source or a cyclic dependency is only found then, and the sources must not change until the chunks are done.
+     * This is a std::generator<std::string_view> where the standard library provides one, or else a chunk_range,
+     * and either one is a single-pass input range whose chunks are valid until it is advanced.
+     * Like merge_to(), it does not use or fill the cache of merged outputs.
+     * @param _root The name of the root source.
+     * @param _max_chunk The most bytes in a chunk.
+     * @return The chunks of the merged source.
+     */
+    chunk_sequence merge_chunks(const std::string &_root, size_t _max_chunk = default_chunk_size) const {
+#ifdef __cpp_lib_generator
+        return generate_chunks(find(_root), _max_chunk);
+#else
+        return chunk_range{*this, find(_root), _max_chunk};
+#endif
+    }
+
+    /**
+     * Merge many roots in one batch, and get the same outputs as merging each root separately.
+     * The batch scans each source once, reuses its scratch state across merges,
+     * and copies a source's expansion from an earlier merge instead of expanding it again whenever it can.
+     * @param _roots The names of the root sources.
+     * @return The merged source of each root, in the same order as _roots.
+     */
+    std::vector<std::string> merge_batch(const std::vector<std::string> &_roots) {
+        return take(merge_roots(_roots, nullptr));
+    }
 
-            // Update modified content.
-            modified[name] = source;
-            sorted.pop(); // Pop at the end, because name is a reference.
+    /**
+     * Merge many roots in one batch.
+     * @param _roots The names of the root sources.
+     * @param _token Cancels the batch.
+     * @return The merged source of each root, in the same order as _roots.
+     * @throws merge_cancelled If the batch was cancelled.
+     */
+    std::vector<std::string> merge_batch(const std::vector<std::string> &_roots, const cancel_token &_token) {
+        return take(merge_roots(_roots, &_token));
+    }
+
+    /**
+     * Merge a root again, and report whether its merged bytes changed since the last remerge of the root.
+     * If the hashes of every segment which contributes to the output match the last remerge, nothing is assembled.
+     * Otherwise the hash and length of the assembled output are compared with the last remerge,
+     * so edits which do not reach the output, such as to an `#include` which is deduplicated away, are still unchanged.
+     * @param _root The name of the root source.
+     * @param _out Receives the merged source, if it was assembled.
+     * @return Whether the merged bytes changed, and whether they were assembled.
+     */
+    remerge_result remerge(const std::string &_root, std::string &_out) {
+        const source_entry &root = find(_root);
+        merge_scratch scratch;
+        scratch.epoch_ = 1;
+        scratch.emitted_.emplace_back();
+        node_scratch &node = get_scratch(scratch, root);
+        emit(scratch, root, node);
+        hasher input;
+        hash_expand(scratch, node, input);
+
+        auto iter = outputs_.find(std::string_view{_root});
+        const bool known = iter != outputs_.end();
+        if (!known) {
+            iter = outputs_.try_emplace(tracked_string{_root, allocator<char>(memory_category::names)}).first;
+        }
+        output_record &record = iter->second;
+        if (known && record.input_hash_ == input.digest()) {
+            return remerge_result{false, false, record.hash_, record.length_};
         }
 
-        // Return the last modified content. This should contain all the sources combined.
-        return source;
+        _out = merge(_root);
+        const uint64_t hash = hasher::of(_out);
+        const bool changed = !known || record.hash_ != hash || record.length_ != _out.size();
+        record = output_record{input.digest(), hash, _out.size()};
+        return remerge_result{changed, true, hash, _out.size()};
+    }
+
+    /**
+     * Set the byte budget of the cache of merged outputs. The cache is disabled by default.
+     * When the budget is exceeded, the least recently used outputs are evicted, and merged again when they are next needed.
+     * Removing a source drops the cached output of every root which reaches it.
+     * @param _bytes The byte budget. 0 disables the cache and drops everything in it.
+     */
+    void set_cache_budget(size_t _bytes) {
+        cache_budget_ = _bytes;
+        while (!cache_.empty() && cache_stats_.bytes > cache_budget_) {
+            ++cache_stats_.evictions;
+            cache_erase(std::prev(cache_.end()));
+        }
+    }
+
+    /**
+     * @return The statistics of the cache of merged outputs.
+     */
+    cache_stats cache_statistics() const {
+        cache_stats out = cache_stats_;
+        out.entries = cache_.size();
+        out.budget = cache_budget_;
+        return out;
+    }
+
+    /**
+     * Get the memory allocated by this glsl_include, by category.
+     * Every container counts the exact bytes it requests, including its nodes and buckets, so the numbers are not estimates.
+     * @return The bytes allocated in each category.
+     */
+    memory_usage memory() const {
+        return counters_->usage();
     }
 };
 }
@@ -0,0 +1,180 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Byte offset <-> line number conversion for sources.
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define MKR_GLSL_LINE_TABLE_SSE2
+#if defined(__AVX2__)
+#define MKR_GLSL_LINE_TABLE_AVX2
+#elif defined(__GNUC__)
+// Without -mavx2, GCC and Clang can still compile an AVX2 path and select it at runtime.
+#define MKR_GLSL_LINE_TABLE_AVX2
+#define MKR_GLSL_LINE_TABLE_AVX2_DISPATCH
+#endif
+#endif
+
+namespace mkr {
+/**
+ * The start offset of every line in a source, built once by a vectorised newline scan.
+ * Lines are numbered from 0. A source with no newlines has 1 line.
+ */
+template<typename Allocator = std::allocator<std::uint32_t>>
+class basic_line_table {
+ public:
+    using starts_type = std::vector<std::uint32_t, Allocator>;
+
+ private:
+    starts_type starts_{0};
+    std::uint32_t size_ = 0;
+
+    // Record the line which starts after each newline in [_begin, _begin + _len), where _base is the offset of _begin.
+    static void scan_scalar(const char *_begin, std::size_t _len, std::uint32_t _base, starts_type &_starts) {
+        const char *end = _begin + _len;
+        for (const char *iter = _begin; (iter = static_cast<const char *>(std::memchr(iter, '\n', end - iter))) != nullptr; ++iter) {
+            _starts.push_back(_base + static_cast<std::uint32_t>(iter - _begin) + 1);
+        }
+    }
+
+    static void push_mask(std::uint32_t _mask, std::uint32_t _offset, starts_type &_starts) {
+        while (_mask != 0) {
+            _starts.push_back(_offset + static_cast<std::uint32_t>(std::countr_zero(_mask)) + 1);
+            _mask &= _mask - 1;
+        }
+    }
+
+#ifdef MKR_GLSL_LINE_TABLE_SSE2
+    static std::size_t scan_sse2(const char *_source, std::size_t _len, std::uint32_t _base, starts_type &_starts) {
+        const __m128i newline = _mm_set1_epi8('\n');
+        std::size_t pos = 0;
+        for (; pos + 16 <= _len; pos += 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(_source + pos));
+            push_mask(static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline))), _base + static_cast<std::uint32_t>(pos), _starts);
+        }
+        return pos;
+    }
+#endif
+
+#ifdef MKR_GLSL_LINE_TABLE_AVX2
+#ifdef MKR_GLSL_LINE_TABLE_AVX2_DISPATCH
+    __attribute__((target("avx2")))
+#endif
+    static std::size_t scan_avx2(const char *_source, std::size_t _len, std::uint32_t _base, starts_type &_starts) {
+        const __m256i newline = _mm256_set1_epi8('\n');
+        std::size_t pos = 0;
+        for (; pos + 32 <= _len; pos += 32) {
+            const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(_source + pos));
+            push_mask(static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline))), _base + static_cast<std::uint32_t>(pos), _starts);
+        }
+        return pos;
+    }
+
+    static bool has_avx2() {
+#ifdef MKR_GLSL_LINE_TABLE_AVX2_DISPATCH
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+#else
+        return true;
+#endif
+    }
+#endif
+
+    // Record the line which starts after each newline in _source, where _base is the offset of _source.
+    static void scan(std::string_view _source, std::uint32_t _base, starts_type &_starts) {
+        std::size_t pos = 0;
+#if defined(MKR_GLSL_LINE_TABLE_AVX2)
+        if (has_avx2()) {
+            pos = scan_avx2(_source.data(), _source.size(), _base, _starts);
+        } else {
+            pos = scan_sse2(_source.data(), _source.size(), _base, _starts);
+        }
+#elif defined(MKR_GLSL_LINE_TABLE_SSE2)
+        pos = scan_sse2(_source.data(), _source.size(), _base, _starts);
+#endif
+        scan_scalar(_source.data() + pos, _source.size() - pos, _base + static_cast<std::uint32_t>(pos), _starts);
+    }
+
+ public:
+    basic_line_table() = default;
+
+    /**
+     * Build the line table of a source.
+     * @param _source The source. Must be smaller than 4GiB.
+     * @param _alloc The allocator of the table.
+     */
+    explicit basic_line_table(std::string_view _source, const Allocator &_alloc = Allocator())
+        : starts_(1, 0, _alloc), size_(static_cast<std::uint32_t>(_source.size())) {
+        if (_source.size() > UINT32_MAX) {
+            throw std::runtime_error("glsl_include - Source is too large to index.");
+        }
+        starts_.reserve(_source.size() / 32 + 1);
+        scan(_source, 0, starts_);
+        starts_.shrink_to_fit();
+    }
+
+    /**
+     * Start the line table of a source which is read in chunks. See append().
+     * @param _alloc The allocator of the table.
+     */
+    explicit basic_line_table(const Allocator &_alloc) : starts_(1, 0, _alloc) {}
+
+    /**
+     * Extend the table with the next chunk of a source which is read in chunks.
+     * Appending every chunk of a source in order builds the same table as building it from the whole source.
+     * @param _chunk The next chunk. The source must stay smaller than 4GiB.
+     */
+    void append(std::string_view _chunk) {
+        if (_chunk.size() > UINT32_MAX - size_) {
+            throw std::runtime_error("glsl_include - Source is too large to index.");
+        }
+        scan(_chunk, size_, starts_);
+        size_ += static_cast<std::uint32_t>(_chunk.size());
+    }
+
+    ~basic_line_table() = default;
+
+    /**
+     * @return The number of lines.
+     */
+    std::size_t num_lines() const { return starts_.size(); }
+
+    /**
+     * Get the line containing a byte offset, using binary search.
+     * @param _offset The byte offset. Offsets past the end map to the last line.
+     * @return The line number, starting from 0.
+     */
+    std::size_t line_of(std::size_t _offset) const {
+        return std::upper_bound(starts_.begin(), starts_.end(), _offset) - starts_.begin() - 1;
+    }
+
+    /**
+     * @return The byte offset of the start of a line.
+     */
+    std::size_t line_begin(std::size_t _line) const { return starts_[_line]; }
+
+    /**
+     * @return The byte offset of the end of a line, excluding its newline.
+     */
+    std::size_t line_end(std::size_t _line) const {
+        return _line + 1 < starts_.size() ? starts_[_line + 1] - 1 : size_;
+    }
+
+    /**
+     * @return The byte offset of the start of every line.
+     */
+    const starts_type &starts() const { return starts_; }
+};
+
+using line_table = basic_line_table<>;
+}
@@ -0,0 +1,137 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Allocator which accounts for memory by category.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace mkr {
+/**
+ * The categories of memory which glsl_include accounts for.
+ */
+enum class memory_category : uint8_t {
+    sources, // Source text.
+    names, // Source names.
+    metadata, // Directives, segment hashes and line tables of sources.
+    graph, // The index of sources and the records of remerged roots.
+    caches, // Cached merged outputs and their indices.
+    num_categories,
+};
+
+/**
+ * Bytes allocated by glsl_include, by category.
+ * These are the exact sizes requested from the allocator, including container overhead such as nodes and buckets.
+ */
+struct memory_usage {
+    size_t sources = 0;
+    size_t names = 0;
+    size_t metadata = 0;
+    size_t graph = 0;
+    size_t caches = 0;
+
+    size_t total() const { return sources + names + metadata + graph + caches; }
+};
+
+/**
+ * The byte counters of each memory category. Shared by every allocator which counts into them.
+ */
+class memory_counters {
+ private:
+    std::array<std::atomic<size_t>, static_cast<size_t>(memory_category::num_categories)> bytes_{};
+
+ public:
+    memory_counters() = default;
+
+    ~memory_counters() = default;
+
+    void add(memory_category _category, size_t _bytes) { bytes_[static_cast<size_t>(_category)].fetch_add(_bytes, std::memory_order_relaxed); }
+
+    void sub(memory_category _category, size_t _bytes) { bytes_[static_cast<size_t>(_category)].fetch_sub(_bytes, std::memory_order_relaxed); }
+
+    size_t bytes(memory_category _category) const { return bytes_[static_cast<size_t>(_category)].load(std::memory_order_relaxed); }
+
+    memory_usage usage() const {
+        return memory_usage{bytes(memory_category::sources), bytes(memory_category::names), bytes(memory_category::metadata),
+                            bytes(memory_category::graph), bytes(memory_category::caches)};
+    }
+};
+
+/**
+ * An allocator which counts the bytes it allocates into a memory category.
+ * The counters are shared, so they outlive any container still using them.
+ */
+template<typename T>
+class tracked_allocator {
+ private:
+    template<typename U> friend class tracked_allocator;
+
+    std::shared_ptr<memory_counters> counters_;
+    memory_category category_ = memory_category::sources;
+
+ public:
+    using value_type = T;
+    // Containers take their allocator with them when they are assigned or swapped, so their memory stays accounted to its owner.
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    // Counts nothing. Only exists so that containers of tracked types stay default constructible.
+    tracked_allocator() = default;
+
+    tracked_allocator(std::shared_ptr<memory_counters> _counters, memory_category _category)
+        : counters_(std::move(_counters)), category_(_category) {}
+
+    // Moving copies the counters, so a moved-from container can still release its memory.
+    tracked_allocator(const tracked_allocator &) = default;
+
+    template<typename U>
+    tracked_allocator(const tracked_allocator<U> &_other) : counters_(_other.counters_), category_(_other.category_) {}
+
+    tracked_allocator &operator=(const tracked_allocator &) = default;
+
+    ~tracked_allocator() = default;
+
+    T *allocate(size_t _n) {
+        T *out = std::allocator<T>{}.allocate(_n);
+        if (counters_) { counters_->add(category_, _n * sizeof(T)); }
+        return out;
+    }
+
+    void deallocate(T *_ptr, size_t _n) {
+        std::allocator<T>{}.deallocate(_ptr, _n);
+        if (counters_) { counters_->sub(category_, _n * sizeof(T)); }
+    }
+
+    template<typename U>
+    bool operator==(const tracked_allocator<U> &_other) const {
+        return counters_ == _other.counters_ && category_ == _other.category_;
+    }
+};
+
+template<typename T>
+using tracked_vector = std::vector<T, tracked_allocator<T>>;
+
+template<typename T>
+using tracked_list = std::list<T, tracked_allocator<T>>;
+
+template<typename K, typename V, typename Hash = std::hash<K>, typename Eq = std::equal_to<K>>
+using tracked_map = std::unordered_map<K, V, Hash, Eq, tracked_allocator<std::pair<const K, V>>>;
+
+template<typename K, typename Hash = std::hash<K>, typename Eq = std::equal_to<K>>
+using tracked_set = std::unordered_set<K, Hash, Eq, tracked_allocator<K>>;
+
+using tracked_string = std::basic_string<char, std::char_traits<char>, tracked_allocator<char>>;
+}
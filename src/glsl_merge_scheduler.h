@@ -0,0 +1,300 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Optional scheduler which runs merges on a worker thread in priority order.
+// See README.md for usage example.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "glsl_include.h"
+
+namespace mkr {
+/**
+ * Priority classes of scheduled tasks. A queued task always runs before queued tasks of a lower priority.
+ */
+enum class merge_priority : uint8_t {
+    interactive, // For example, shaders in the visible viewport.
+    normal,
+    background, // For example, re-cooking the whole library.
+    num_priorities,
+};
+
+/**
+ * Histogram of task latencies, from when a task is queued to when it finishes.
+ * Bucket i counts latencies in [2^i, 2^(i+1)) microseconds, except bucket 0 which also counts latencies under 1 microsecond.
+ */
+class latency_histogram {
+ public:
+    static constexpr size_t num_buckets = 32;
+
+ private:
+    std::array<uint64_t, num_buckets> buckets_{};
+    uint64_t count_ = 0;
+    uint64_t total_us_ = 0;
+    uint64_t max_us_ = 0;
+
+ public:
+    latency_histogram() = default;
+
+    ~latency_histogram() = default;
+
+    /**
+     * Record a latency.
+     * @param _latency_us The latency in microseconds.
+     */
+    void record(uint64_t _latency_us) {
+        const size_t bucket = _latency_us == 0 ? 0 : static_cast<size_t>(std::bit_width(_latency_us)) - 1;
+        ++buckets_[std::min(bucket, num_buckets - 1)];
+        ++count_;
+        total_us_ += _latency_us;
+        max_us_ = std::max(max_us_, _latency_us);
+    }
+
+    /**
+     * @return The number of latencies recorded in a bucket.
+     */
+    uint64_t bucket(size_t _bucket) const { return buckets_[_bucket]; }
+
+    /**
+     * @return The number of latencies recorded.
+     */
+    uint64_t count() const { return count_; }
+
+    /**
+     * @return The mean latency in microseconds.
+     */
+    double mean_us() const { return count_ == 0 ? 0.0 : static_cast<double>(total_us_) / static_cast<double>(count_); }
+
+    /**
+     * @return The highest latency in microseconds.
+     */
+    uint64_t max_us() const { return max_us_; }
+
+    /**
+     * Get an upper bound of a percentile, such as 0.99 for the 99th percentile.
+     * @return The upper bound of the bucket containing the percentile, in microseconds.
+     */
+    uint64_t percentile_us(double _percentile) const {
+        const auto target = static_cast<uint64_t>(_percentile * static_cast<double>(count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < num_buckets; ++i) {
+            seen += buckets_[i];
+            if (seen > target || seen == count_) { return std::min(max_us_, (uint64_t{2} << i) - 1); }
+        }
+        return max_us_;
+    }
+};
+
+/**
+ * Runs merges and other tasks on a worker thread, always picking the highest priority queued task next.
+ * A running task is never interrupted, so a newly queued interactive merge waits for at most one task.
+ * While the scheduler exists, only use the glsl_include through the scheduler, by submitting merges or posting other tasks.
+ * This includes merges: a merge looks read-only, but it updates the cache of merged outputs and its statistics,
+ * and analyses sources on first use, so a merge on another thread would race with the worker.
+ */
+class merge_scheduler {
+ private:
+    using clock = std::chrono::steady_clock;
+
+    // A task returns a function which publishes its result, so that its latency is recorded before anyone can see the result.
+    using task_fn = std::function<std::function<void()>(glsl_include &)>;
+
+    struct task {
+        task_fn run_;
+        clock::time_point queued_;
+        std::string root_; // The root merged by this task, or empty if it is not a merge.
+        cancel_token token_;
+        std::function<void()> drop_; // Fails the task's future without running it.
+    };
+
+    glsl_include &include_;
+    std::array<std::deque<task>, static_cast<size_t>(merge_priority::num_priorities)> queues_;
+    std::array<latency_histogram, static_cast<size_t>(merge_priority::num_priorities)> histograms_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::string running_root_; // The root merged by the running task, or empty.
+    cancel_token running_token_;
+    std::thread worker_;
+
+    void run() {
+        std::unique_lock lock{mutex_};
+        while (true) {
+            cv_.wait(lock, [this] { return stop_ || num_queued() != 0; });
+            if (stop_) { return; }
+
+            for (size_t p = 0; p < queues_.size(); ++p) {
+                if (queues_[p].empty()) { continue; }
+                task next = std::move(queues_[p].front());
+                queues_[p].pop_front();
+
+                running_root_ = next.root_;
+                running_token_ = next.token_;
+                lock.unlock();
+                auto publish = next.run_(include_);
+                const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - next.queued_);
+                lock.lock();
+
+                histograms_[p].record(static_cast<uint64_t>(latency.count()));
+                running_root_.clear();
+                lock.unlock();
+                publish();
+                lock.lock();
+                break;
+            }
+        }
+    }
+
+    size_t num_queued() const {
+        size_t n = 0;
+        for (const auto &queue : queues_) { n += queue.size(); }
+        return n;
+    }
+
+    void enqueue(task _task, merge_priority _priority) {
+        _task.queued_ = clock::now();
+        {
+            std::lock_guard lock{mutex_};
+            queues_[static_cast<size_t>(_priority)].push_back(std::move(_task));
+        }
+        cv_.notify_one();
+    }
+
+    static task make_merge(const std::string &_root, std::future<std::string> &_future) {
+        auto promise = std::make_shared<std::promise<std::string>>();
+        _future = promise->get_future();
+        task out;
+        out.root_ = _root;
+        out.run_ = [promise, _root, token = out.token_](glsl_include &_include) -> std::function<void()> {
+            try {
+                return [promise, merged = _include.merge(_root, token)]() mutable { promise->set_value(std::move(merged)); };
+            } catch (...) {
+                return [promise, error = std::current_exception()] { promise->set_exception(error); };
+            }
+        };
+        out.drop_ = [promise] { promise->set_exception(std::make_exception_ptr(merge_cancelled())); };
+        return out;
+    }
+
+ public:
+    /**
+     * Start the worker thread.
+     * @param _include The sources to merge. Must outlive the scheduler, and is only used by the worker thread while the scheduler exists.
+     */
+    explicit merge_scheduler(glsl_include &_include) : include_(_include) {
+        worker_ = std::thread([this] { run(); });
+    }
+
+    /**
+     * Wait for the running task to finish, then stop. Tasks which have not started are dropped,
+     * and their futures throw std::future_error with std::future_errc::broken_promise.
+     */
+    ~merge_scheduler() {
+        {
+            std::lock_guard lock{mutex_};
+            stop_ = true;
+        }
+        cv_.notify_one();
+        worker_.join();
+    }
+
+    merge_scheduler(const merge_scheduler &) = delete;
+
+    merge_scheduler &operator=(const merge_scheduler &) = delete;
+
+    /**
+     * Queue a merge of a root.
+     * @param _root The name of the root source.
+     * @param _priority The priority class of the merge.
+     * @return The merged source, or the exception thrown by the merge.
+     */
+    std::future<std::string> submit(const std::string &_root, merge_priority _priority = merge_priority::normal) {
+        std::future<std::string> future;
+        enqueue(make_merge(_root, future), _priority);
+        return future;
+    }
+
+    /**
+     * Queue a merge of a root, superseding every earlier merge of the same root.
+     * Queued merges of the root are dropped, and a running merge of the root is cancelled.
+     * Their futures throw merge_cancelled, so only the latest state of the root is merged.
+     * The new merge takes the highest priority class of the merges it drops.
+     * @param _root The name of the root source.
+     * @param _priority The priority class of the merge.
+     * @return The merged source, or the exception thrown by the merge.
+     */
+    std::future<std::string> submit_latest(const std::string &_root, merge_priority _priority = merge_priority::normal) {
+        std::future<std::string> future;
+        task merge = make_merge(_root, future);
+        merge.queued_ = clock::now();
+        {
+            std::lock_guard lock{mutex_};
+            if (running_root_ == _root) { running_token_.cancel(); }
+            for (size_t p = 0; p < queues_.size(); ++p) {
+                auto &queue = queues_[p];
+                for (auto iter = queue.begin(); iter != queue.end();) {
+                    if (iter->root_ != _root) {
+                        ++iter;
+                        continue;
+                    }
+                    iter->drop_();
+                    iter = queue.erase(iter);
+                    _priority = std::min(_priority, static_cast<merge_priority>(p));
+                }
+            }
+            queues_[static_cast<size_t>(_priority)].push_back(std::move(merge));
+        }
+        cv_.notify_one();
+        return future;
+    }
+
+    /**
+     * Queue a task, such as adding or removing sources, or any other use of the glsl_include which is not a plain merge.
+     * @param _fn The task.
+     * @param _priority The priority class of the task.
+     * @return Signals when the task has finished, or holds the exception thrown by the task.
+     */
+    std::future<void> post(std::function<void(glsl_include &)> _fn, merge_priority _priority = merge_priority::interactive) {
+        auto promise = std::make_shared<std::promise<void>>();
+        auto future = promise->get_future();
+        task out;
+        out.run_ = [promise, fn = std::move(_fn)](glsl_include &_include) -> std::function<void()> {
+            try {
+                fn(_include);
+                return [promise] { promise->set_value(); };
+            } catch (...) {
+                return [promise, error = std::current_exception()] { promise->set_exception(error); };
+            }
+        };
+        enqueue(std::move(out), _priority);
+        return future;
+    }
+
+    /**
+     * @return The number of queued tasks of a priority class which have not started.
+     */
+    size_t pending(merge_priority _priority) const {
+        std::lock_guard lock{mutex_};
+        return queues_[static_cast<size_t>(_priority)].size();
+    }
+
+    /**
+     * @return A copy of the latency histogram of a priority class.
+     */
+    latency_histogram histogram(merge_priority _priority) const {
+        std::lock_guard lock{mutex_};
+        return histograms_[static_cast<size_t>(_priority)];
+    }
+};
+}
@@ -0,0 +1,329 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Hash map whose copies share structure, for cheap forks of glsl_include.
+
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+namespace mkr {
+/**
+ * A hash array mapped trie. Copying the map is O(1), and the copies share every node and leaf until one of them changes it.
+ * A change copies only the nodes on the path to the changed leaf, and only if they are shared, so a map which is not shared
+ * is changed in place.
+ * Lookups take the key types that Hash and Equal accept, so transparent functors allow lookups without building a Key.
+ */
+template<typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>,
+         typename Allocator = std::allocator<char>>
+class persistent_map {
+ private:
+    static constexpr size_t bits = 5;
+    static constexpr size_t width = size_t{1} << bits;
+    static constexpr size_t hash_bits = std::numeric_limits<size_t>::digits;
+
+    struct leaf {
+        size_t hash_ = 0;
+        Key key_;
+        Value value_;
+    };
+
+    struct node;
+    using leaf_ptr = std::shared_ptr<leaf>;
+    using node_ptr = std::shared_ptr<node>;
+
+    // Holds either a child node or a leaf.
+    struct slot {
+        node_ptr node_;
+        leaf_ptr leaf_;
+    };
+
+    using slot_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<slot>;
+
+    // Each level of the trie takes the next bits of the hash. The bitmap records which of the 32 slots are in use,
+    // and only those are stored, in order. Below the last bits of the hash, a node is a list of leaves whose hashes are equal.
+    struct node {
+        uint32_t bitmap_ = 0;
+        std::vector<slot, slot_allocator> slots_;
+    };
+
+    Allocator alloc_;
+    node_ptr root_;
+    size_t size_ = 0;
+
+    static size_t index(size_t _hash, size_t _shift) {
+        return (_hash >> _shift) & (width - 1);
+    }
+
+    static size_t position(uint32_t _bitmap, size_t _index) {
+        return std::popcount(_bitmap & ((uint32_t{1} << _index) - 1));
+    }
+
+    template<typename K>
+    static bool matches(const leaf &_leaf, size_t _hash, const K &_key) {
+        return _leaf.hash_ == _hash && Equal{}(_leaf.key_, _key);
+    }
+
+    node_ptr make_node() const {
+        return std::allocate_shared<node>(alloc_, node{0, std::vector<slot, slot_allocator>(slot_allocator(alloc_))});
+    }
+
+    // Make a node unique to this map before changing it. Its children are shared with the copy it was taken from.
+    void own(node_ptr &_node) const {
+        if (!_node) {
+            _node = make_node();
+        } else if (_node.use_count() != 1) {
+            _node = std::allocate_shared<node>(alloc_, node{_node->bitmap_, std::vector<slot, slot_allocator>(_node->slots_, slot_allocator(alloc_))});
+        }
+    }
+
+    template<typename K>
+    const leaf *find_leaf(const K &_key) const {
+        const size_t hash = Hash{}(_key);
+        const node *current = root_.get();
+        for (size_t shift = 0; current; shift += bits) {
+            if (shift >= hash_bits) {
+                for (const slot &entry : current->slots_) {
+                    if (matches(*entry.leaf_, hash, _key)) { return entry.leaf_.get(); }
+                }
+                return nullptr;
+            }
+            const size_t idx = index(hash, shift);
+            if ((current->bitmap_ >> idx & 1) == 0) { return nullptr; }
+            const slot &entry = current->slots_[position(current->bitmap_, idx)];
+            if (entry.leaf_) { return matches(*entry.leaf_, hash, _key) ? entry.leaf_.get() : nullptr; }
+            current = entry.node_.get();
+        }
+        return nullptr;
+    }
+
+    // Make the path to a key unique to this map, adding nodes where it does not exist yet.
+    // Returns the slot of the key's leaf, which is empty if the key was not in the map.
+    template<typename K>
+    leaf_ptr &locate(const K &_key, size_t _hash) {
+        node_ptr *current = &root_;
+        for (size_t shift = 0;; shift += bits) {
+            own(*current);
+            node &parent = **current;
+            if (shift >= hash_bits) {
+                for (slot &entry : parent.slots_) {
+                    if (matches(*entry.leaf_, _hash, _key)) { return entry.leaf_; }
+                }
+                return parent.slots_.emplace_back().leaf_;
+            }
+
+            const size_t idx = index(_hash, shift);
+            const size_t pos = position(parent.bitmap_, idx);
+            if ((parent.bitmap_ >> idx & 1) == 0) {
+                parent.bitmap_ |= uint32_t{1} << idx;
+                return parent.slots_.emplace(parent.slots_.begin() + pos)->leaf_;
+            }
+            slot &entry = parent.slots_[pos];
+            if (entry.leaf_) {
+                if (matches(*entry.leaf_, _hash, _key)) { return entry.leaf_; }
+                // Push the other leaf down a level, and carry on into the new node.
+                const size_t next = shift + bits;
+                entry.node_ = make_node();
+                if (next < hash_bits) { entry.node_->bitmap_ = uint32_t{1} << index(entry.leaf_->hash_, next); }
+                entry.node_->slots_.push_back(slot{nullptr, std::move(entry.leaf_)});
+            }
+            current = &entry.node_;
+        }
+    }
+
+    // Remove a key which is in the subtree of _node. A child left with a single leaf is replaced by that leaf.
+    template<typename K>
+    void erase(node_ptr &_node, size_t _shift, size_t _hash, const K &_key) {
+        own(_node);
+        node &parent = *_node;
+        size_t pos = 0;
+        if (_shift >= hash_bits) {
+            while (!matches(*parent.slots_[pos].leaf_, _hash, _key)) { ++pos; }
+        } else {
+            const size_t idx = index(_hash, _shift);
+            pos = position(parent.bitmap_, idx);
+            slot &entry = parent.slots_[pos];
+            if (entry.node_) {
+                erase(entry.node_, _shift + bits, _hash, _key);
+                if (entry.node_->slots_.size() == 1 && entry.node_->slots_.front().leaf_) {
+                    entry.leaf_ = entry.node_->slots_.front().leaf_;
+                    entry.node_.reset();
+                }
+                return;
+            }
+            parent.bitmap_ &= ~(uint32_t{1} << idx);
+        }
+        parent.slots_.erase(parent.slots_.begin() + pos);
+    }
+
+    static const slot *slot_at(const node &_node, size_t _index) {
+        return (_node.bitmap_ >> _index & 1) == 0 ? nullptr : &_node.slots_[position(_node.bitmap_, _index)];
+    }
+
+    static void gather(const node *_node, std::vector<const leaf *> &_out) {
+        if (!_node) { return; }
+        for (const slot &entry : _node->slots_) { gather(entry, _out); }
+    }
+
+    static void gather(const slot &_slot, std::vector<const leaf *> &_out) {
+        if (_slot.leaf_) {
+            _out.push_back(_slot.leaf_.get());
+        } else {
+            gather(_slot.node_.get(), _out);
+        }
+    }
+
+    // Compare two sets of leaves by key. Only used where the sets are small, or where one of them is empty.
+    template<typename Fn>
+    static void diff(const std::vector<const leaf *> &_old, const std::vector<const leaf *> &_new, Fn &_fn) {
+        auto find = [](const std::vector<const leaf *> &_leaves, const leaf &_leaf) -> const leaf * {
+            for (const leaf *other : _leaves) {
+                if (other->hash_ == _leaf.hash_ && Equal{}(other->key_, _leaf.key_)) { return other; }
+            }
+            return nullptr;
+        };
+        for (const leaf *old_leaf : _old) {
+            const leaf *new_leaf = find(_new, *old_leaf);
+            if (new_leaf != old_leaf) {
+                _fn(static_cast<const Key &>(old_leaf->key_), &old_leaf->value_, new_leaf ? &new_leaf->value_ : nullptr);
+            }
+        }
+        for (const leaf *new_leaf : _new) {
+            if (!find(_old, *new_leaf)) { _fn(static_cast<const Key &>(new_leaf->key_), static_cast<const Value *>(nullptr), &new_leaf->value_); }
+        }
+    }
+
+    template<typename Fn>
+    static void diff(const node *_old, const node *_new, size_t _shift, Fn &_fn) {
+        if (_old == _new) { return; }
+        if (!_old || !_new || _shift >= hash_bits) {
+            std::vector<const leaf *> old_leaves, new_leaves;
+            gather(_old, old_leaves);
+            gather(_new, new_leaves);
+            diff(old_leaves, new_leaves, _fn);
+            return;
+        }
+        for (size_t idx = 0; idx < width; ++idx) {
+            const slot *old_slot = slot_at(*_old, idx);
+            const slot *new_slot = slot_at(*_new, idx);
+            if (old_slot && new_slot && old_slot->node_ && new_slot->node_) {
+                diff(old_slot->node_.get(), new_slot->node_.get(), _shift + bits, _fn);
+            } else if ((old_slot || new_slot) && !(old_slot && new_slot && old_slot->leaf_ == new_slot->leaf_)) {
+                // A leaf on either side means that the other side holds few leaves that can match it.
+                std::vector<const leaf *> old_leaves, new_leaves;
+                if (old_slot) { gather(*old_slot, old_leaves); }
+                if (new_slot) { gather(*new_slot, new_leaves); }
+                diff(old_leaves, new_leaves, _fn);
+            }
+        }
+    }
+
+    template<typename Fn>
+    static void for_each(const node &_node, Fn &_fn) {
+        for (const slot &entry : _node.slots_) {
+            if (entry.leaf_) {
+                _fn(static_cast<const Key &>(entry.leaf_->key_), static_cast<const Value &>(entry.leaf_->value_));
+            } else {
+                for_each(*entry.node_, _fn);
+            }
+        }
+    }
+
+ public:
+    explicit persistent_map(const Allocator &_alloc = Allocator()) : alloc_(_alloc) {}
+
+    /**
+     * Share the contents of another map. Nodes which this map copies or adds later are allocated with _alloc.
+     */
+    persistent_map(const persistent_map &_other, const Allocator &_alloc) : alloc_(_alloc), root_(_other.root_), size_(_other.size_) {}
+
+    persistent_map(const persistent_map &) = default;
+
+    persistent_map(persistent_map &&) = default;
+
+    ~persistent_map() = default;
+
+    persistent_map &operator=(const persistent_map &) = default;
+
+    persistent_map &operator=(persistent_map &&) = default;
+
+    size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    /**
+     * @return The value of a key, or nullptr if the key is not in the map.
+     */
+    template<typename K>
+    const Value *find(const K &_key) const {
+        const leaf *found = find_leaf(_key);
+        return found ? &found->value_ : nullptr;
+    }
+
+    template<typename K>
+    bool contains(const K &_key) const { return find_leaf(_key) != nullptr; }
+
+    /**
+     * Get the value of a key to change it. If the value is shared with a copy of the map, it is copied first,
+     * so the returned value may be at a different address than find() returned before.
+     * @return The value of the key, or nullptr if the key is not in the map.
+     */
+    template<typename K>
+    Value *find_mutable(const K &_key) {
+        if (!find_leaf(_key)) { return nullptr; }
+        leaf_ptr &found = locate(_key, Hash{}(_key));
+        if (found.use_count() != 1) { found = std::allocate_shared<leaf>(alloc_, *found); }
+        return &found->value_;
+    }
+
+    /**
+     * Insert a key, or replace its value if it is already in the map. The value is always stored in a new leaf.
+     * @return The stored value.
+     */
+    Value &insert_or_assign(Key _key, Value _value) {
+        const size_t hash = Hash{}(_key);
+        leaf_ptr &found = locate(_key, hash);
+        if (!found) { ++size_; }
+        found = std::allocate_shared<leaf>(alloc_, leaf{hash, std::move(_key), std::move(_value)});
+        return found->value_;
+    }
+
+    /**
+     * Remove a key.
+     * @return Whether the key was in the map.
+     */
+    template<typename K>
+    bool erase(const K &_key) {
+        if (!find_leaf(_key)) { return false; }
+        erase(root_, 0, Hash{}(_key), _key);
+        if (--size_ == 0) { root_.reset(); }
+        return true;
+    }
+
+    void clear() {
+        root_.reset();
+        size_ = 0;
+    }
+
+    /**
+     * Call _fn(key, old value, new value) for every key whose entry differs between two maps. A missing value is nullptr.
+     * Subtrees which the maps share are skipped, so comparing a map with a changed copy of it takes time in proportion to the changes.
+     * An entry which was replaced counts as different, even if its new value is equal to the old one.
+     */
+    template<typename Fn>
+    static void diff(const persistent_map &_old, const persistent_map &_new, Fn &&_fn) {
+        diff(_old.root_.get(), _new.root_.get(), 0, _fn);
+    }
+
+    /**
+     * Call _fn(key, value) for every entry, in no particular order.
+     */
+    template<typename Fn>
+    void for_each(Fn &&_fn) const {
+        if (root_) { for_each(*root_, _fn); }
+    }
+};
+}
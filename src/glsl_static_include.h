@@ -0,0 +1,145 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Compile-time include registry for shaders that are compiled into the binary.
+// See README.md for usage example.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "glsl_directive.h"
+
+namespace mkr {
+/**
+ * A string literal that can be used as a template argument, such as `shader_source<"common.frag">`.
+ */
+template<std::size_t N>
+struct fixed_string {
+    char chars_[N]{};
+
+    constexpr fixed_string(const char (&_str)[N]) {
+        std::copy_n(_str, N, chars_);
+    }
+
+    constexpr explicit fixed_string(std::string_view _str) {
+        std::copy_n(_str.data(), N - 1, chars_);
+    }
+
+    constexpr std::string_view view() const {
+        return {chars_, N - 1};
+    }
+};
+
+/**
+ * Specialise this for every embedded source. The specialisation must have a `static constexpr std::string_view source`.
+ * For example:
+ * template<> struct mkr::shader_source<"abc.frag"> { static constexpr std::string_view source = "void abc() {}"; };
+ * Including a name with no specialisation fails to compile.
+ */
+template<fixed_string Name>
+struct shader_source;
+
+/**
+ * A node of the compile-time include graph.
+ * The includes are in the same order as the source's include directives.
+ */
+struct static_source {
+    std::string_view name;
+    std::string_view source;
+    std::span<const static_source *const> includes;
+};
+
+template<fixed_string Name>
+struct static_node {
+ private:
+    static constexpr std::string_view source_ = shader_source<Name>::source;
+    static constexpr std::size_t num_includes_ = directive::count(source_);
+
+    template<std::size_t I>
+    static constexpr std::string_view include_name() {
+        return directive::at(source_, I).name;
+    }
+
+    static constexpr std::array<const static_source *, num_includes_> includes_ = []<std::size_t... I>(std::index_sequence<I...>) {
+        return std::array<const static_source *, num_includes_>{&static_node<fixed_string<include_name<I>().size() + 1>{include_name<I>()}>::value...};
+    }(std::make_index_sequence<num_includes_>{});
+
+ public:
+    static constexpr static_source value{Name.view(), source_, includes_};
+};
+
+class static_include {
+ private:
+    // Deliberately not constexpr, so that reaching it during constant evaluation fails to compile.
+    static void cyclic_dependency_detected() {}
+
+    static constexpr bool contains(const std::vector<const static_source *> &_nodes, const static_source *_node) {
+        return std::find(_nodes.begin(), _nodes.end(), _node) != _nodes.end();
+    }
+
+    // Each source is emitted once, in place of the first directive that includes it in depth-first order.
+    static constexpr void emit(const static_source &_node, std::vector<const static_source *> &_emitted, std::vector<const static_source *> &_path, std::string &_out) {
+        _path.push_back(&_node);
+        std::size_t pos = 0;
+        std::size_t index = 0;
+        directive::for_each(_node.source, [&](const include_directive &_directive) {
+            const static_source *incl = _node.includes[index++];
+            if (contains(_path, incl)) { cyclic_dependency_detected(); }
+
+            _out.append(_node.source.substr(pos, _directive.begin - pos));
+            if (contains(_emitted, incl)) {
+                pos = _directive.erase_end;
+                return;
+            }
+            _emitted.push_back(incl);
+            emit(*incl, _emitted, _path, _out);
+            pos = _directive.splice_end;
+        });
+        _out.append(_node.source.substr(pos));
+        _path.pop_back();
+    }
+
+ public:
+    /**
+     * Merge a root and everything it includes. Usable in constant expressions.
+     * @param _root The root source.
+     * @return The merged source.
+     */
+    static constexpr std::string merge(const static_source &_root) {
+        std::vector<const static_source *> emitted{&_root};
+        std::vector<const static_source *> path;
+        std::string out;
+        emit(_root, emitted, path, out);
+        return out;
+    }
+};
+
+template<fixed_string Root>
+struct static_merge {
+ private:
+    static constexpr std::size_t size_ = static_include::merge(static_node<Root>::value).size();
+
+    static constexpr std::array<char, size_> chars_ = [] {
+        std::array<char, size_> out{};
+        const std::string merged = static_include::merge(static_node<Root>::value);
+        std::copy(merged.begin(), merged.end(), out.begin());
+        return out;
+    }();
+
+ public:
+    static constexpr std::string_view value{chars_.data(), chars_.size()};
+};
+
+/**
+ * The merged source of an embedded root, resolved entirely at compile time.
+ * Missing includes and cyclic dependencies fail to compile.
+ */
+template<fixed_string Root>
+inline constexpr std::string_view static_merge_v = static_merge<Root>::value;
+}
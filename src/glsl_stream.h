@@ -0,0 +1,154 @@
+// Copyright(c) 2024-present, Lim Ngian Xin Terry & mkr_glsl_include contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+// Reading sources in chunks, so that a source never has to be held in memory whole.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace mkr {
+/**
+ * The number of bytes read at a time from a source which is read in chunks, unless another size is given.
+ */
+inline constexpr std::size_t default_chunk_size = 64 * 1024;
+
+/**
+ * Reads a file through a window of a fixed size. Only the window is held in memory.
+ */
+class chunk_reader {
+ private:
+    std::filesystem::path path_;
+    std::ifstream file_;
+    std::string window_;
+    std::uint64_t size_ = 0;
+    std::uint64_t pos_ = 0; // The offset of the next read.
+
+    std::runtime_error error(std::string_view _what) const {
+        return std::runtime_error("glsl_include - Cannot " + std::string{_what} + " file " + path_.string() + ".");
+    }
+
+ public:
+    /**
+     * Open a file.
+     * @param _path The path of the file.
+     * @param _chunk_size The most bytes read at a time.
+     * @throws std::runtime_error If the file cannot be opened.
+     */
+    chunk_reader(const std::filesystem::path &_path, std::size_t _chunk_size)
+        : path_(_path), file_(_path, std::ios::binary), window_(std::max<std::size_t>(_chunk_size, 1), '\0') {
+        if (!file_) { throw error("open"); }
+        file_.seekg(0, std::ios::end);
+        size_ = static_cast<std::uint64_t>(file_.tellg());
+        file_.seekg(0);
+    }
+
+    chunk_reader(chunk_reader &&) = default;
+
+    ~chunk_reader() = default;
+
+    chunk_reader &operator=(chunk_reader &&) = default;
+
+    /**
+     * @return The size of the file when it was opened.
+     */
+    std::uint64_t size() const { return size_; }
+
+    /**
+     * @return The offset of the next read.
+     */
+    std::uint64_t position() const { return pos_; }
+
+    /**
+     * Move the next read to an offset.
+     */
+    void seek(std::uint64_t _offset) {
+        if (_offset == pos_) { return; }
+        file_.clear();
+        file_.seekg(static_cast<std::streamoff>(_offset));
+        pos_ = _offset;
+    }
+
+    /**
+     * Read the next chunk, up to the chunk size and not past _end.
+     * @param _end The offset to stop at.
+     * @return The chunk, which is valid until the next read. Empty at the end of the file.
+     * @throws std::runtime_error If the file is shorter than it was when it was opened.
+     */
+    std::string_view read(std::uint64_t _end = UINT64_MAX) {
+        const std::uint64_t end = std::min(_end, size_);
+        if (pos_ >= end) { return {}; }
+        const std::uint64_t want = std::min<std::uint64_t>(window_.size(), end - pos_);
+        file_.read(window_.data(), static_cast<std::streamsize>(want));
+        if (static_cast<std::uint64_t>(file_.gcount()) != want) { throw error("read"); }
+        pos_ += want;
+        return std::string_view{window_.data(), static_cast<std::size_t>(want)};
+    }
+};
+
+/**
+ * Splits a source which arrives in chunks into lines. A line which spans chunks is carried over until it is complete,
+ * so only that line is copied, and every other line is passed on as a view of its chunk.
+ */
+class line_splitter {
+ private:
+    std::string carry_; // The start of a line which spans chunks.
+    std::uint64_t offset_ = 0; // The offset of the next line.
+
+    template<typename Fn>
+    void emit(std::string_view _line, Fn &_fn) {
+        _fn(_line, offset_);
+        offset_ += _line.size();
+    }
+
+ public:
+    line_splitter() = default;
+
+    ~line_splitter() = default;
+
+    /**
+     * Pass on every line which the chunk completes, including its newline.
+     * @param _chunk The next chunk of the source.
+     * @param _fn Called with each line and its offset in the source.
+     */
+    template<typename Fn>
+    void feed(std::string_view _chunk, Fn &&_fn) {
+        std::size_t pos = 0;
+        if (!carry_.empty()) {
+            const std::size_t newline = _chunk.find('\n');
+            if (newline == std::string_view::npos) {
+                carry_.append(_chunk);
+                return;
+            }
+            carry_.append(_chunk.substr(0, newline + 1));
+            emit(carry_, _fn);
+            carry_.clear();
+            pos = newline + 1;
+        }
+        for (std::size_t newline; (newline = _chunk.find('\n', pos)) != std::string_view::npos; pos = newline + 1) {
+            emit(_chunk.substr(pos, newline + 1 - pos), _fn);
+        }
+        carry_.assign(_chunk.substr(pos));
+    }
+
+    /**
+     * Pass on the last line, if the source does not end with a newline.
+     */
+    template<typename Fn>
+    void finish(Fn &&_fn) {
+        if (!carry_.empty()) { emit(carry_, _fn); }
+        carry_.clear();
+    }
+
+    /**
+     * @return The number of bytes passed on so far.
+     */
+    std::uint64_t offset() const { return offset_; }
+};
+}
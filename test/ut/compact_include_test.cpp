@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+#include <string>
+#include "glsl_compact_include.h"
+#include "glsl_include.h"
+
+using namespace mkr;
+using namespace std;
+
+// Ensure that a compact include merges exactly like glsl_include, including comments, `#if 0` groups and repeated includes.
+TEST(compact_include, case0) {
+    const std::vector<std::pair<std::string, std::string>> sources{
+        {"base.frag", "#include <incl0.frag>\n/*\n#include <incl2.frag>\n*/\n#include <incl1.frag>\nvoid main() {}"},
+        {"incl0.frag", "#include <incl1.frag>  \nincl0 line 0;"},
+        {"incl1.frag", "#if 0\n#include <base.frag>\n#endif\n    #include    <incl2.frag> // trailing\nincl1 line 0;"},
+        {"incl2.frag", "incl2 line 0;"},
+    };
+    glsl_include include;
+    glsl_compact_include compact;
+    for (const auto &[name, source] : sources) {
+        include.add(name, source);
+        compact.add(name, source);
+    }
+    EXPECT_TRUE(compact.num_sources() == 4 && compact.contains("incl1.frag") && !compact.contains("incl3.frag"));
+    for (const auto &[name, source] : sources) {
+        EXPECT_TRUE(compact.merge(name) == include.merge(name));
+    }
+
+    // Replacing a source resolves the includes again, and cycles and missing sources throw.
+    compact.add("incl2.frag", "#include <incl0.frag>\nincl2 line 1;");
+    bool thrown = false;
+    try {
+        compact.merge("base.frag");
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+    compact.add("incl2.frag", "#include <incl3.frag>");
+    thrown = false;
+    try {
+        compact.merge("incl2.frag");
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+    compact.add("incl3.frag", "incl3 line 0;");
+    EXPECT_TRUE(compact.merge("incl1.frag") == "#if 0\n#include <base.frag>\n#endif\nincl3 line 0; // trailing\nincl1 line 0;");
+}
+
+// Ensure that a library of 1M sources is registered and merged within 64 bytes of overhead per source.
+TEST(compact_include, case1) {
+    const size_t n = 1 << 20;
+    glsl_compact_include compact;
+    for (size_t i = 0; i < n; ++i) {
+        std::string source;
+        if (2 * i + 1 < n) { source += "#include <n" + std::to_string(2 * i + 1) + ">\n"; }
+        if (2 * i + 2 < n) { source += "#include <n" + std::to_string(2 * i + 2) + ">\n"; }
+        compact.add("n" + std::to_string(i), source + "f" + std::to_string(i) + ";");
+    }
+    const std::string merged = compact.merge("n0");
+    EXPECT_TRUE(merged.starts_with("f1048575;\nf524287;\n") && merged.ends_with("\nf0;"));
+
+    const memory_usage usage = compact.memory();
+    EXPECT_TRUE(usage.graph < 64 * n);
+}
@@ -2,6 +2,10 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <random>
+#include <algorithm>
+#include <filesystem>
+#include <ranges>
 #include "glsl_include.h"
 
 using namespace mkr;
@@ -91,4 +95,849 @@ TEST(include, case5) {
         error_thrown = true;
     }
     EXPECT_TRUE(error_thrown);
-}
\ No newline at end of file
+}
+
+// Ensure that a single root can be merged, ignoring sources which it does not reach.
+TEST(include, case6) {
+    glsl_include include;
+    include.add("base.frag", file_to_str("case0/base.frag"));
+    include.add("incl0.frag", file_to_str("case0/incl0.frag"));
+    include.add("incl1.frag", file_to_str("case0/incl1.frag"));
+    include.add("incl2.frag", file_to_str("case0/incl2.frag"));
+    include.add("incl3.frag", file_to_str("case0/incl3.frag"));
+    include.add("other.frag", "#include <missing.frag>");
+
+    EXPECT_TRUE(include.merge("base.frag") == file_to_str("case0/result.frag"));
+    EXPECT_TRUE(include.merge("incl3.frag") == file_to_str("case0/incl3.frag"));
+}
+
+// Ensure that a source included by several siblings is emitted before the first sibling that includes it.
+TEST(include, case7) {
+    glsl_include include;
+    include.add("base.frag", "#include <a.frag>\n#include <b.frag>\nvoid main() {}");
+    include.add("a.frag", "#include <c.frag>\nvoid a() {}");
+    include.add("b.frag", "#include <c.frag>\nvoid b() {}");
+    include.add("c.frag", "void c() {}");
+    EXPECT_TRUE(include.merge() == "void c() {}\nvoid a() {}\nvoid b() {}\nvoid main() {}");
+}
+
+// Ensure that a batch of merges gives the same outputs as merging each root separately.
+TEST(include, case8) {
+    glsl_include include;
+    std::vector<std::string> roots;
+    std::mt19937 rng(8);
+    for (int i = 0; i < 60; ++i) {
+        std::string source;
+        for (int j = 0; j < 4; ++j) {
+            int incl = i + 1 + static_cast<int>(rng() % 8);
+            if (incl < 60) { source += "#include <s" + std::to_string(incl) + ".frag>\n"; }
+        }
+        source += "void s" + std::to_string(i) + "() {}";
+        include.add("s" + std::to_string(i) + ".frag", source);
+        roots.push_back("s" + std::to_string(i) + ".frag");
+    }
+    roots.push_back("s0.frag");
+    std::shuffle(roots.begin(), roots.end(), rng);
+
+    auto merged = include.merge_batch(roots);
+    EXPECT_TRUE(merged.size() == roots.size());
+    for (size_t i = 0; i < roots.size(); ++i) {
+        EXPECT_TRUE(merged[i] == include.merge(roots[i]));
+    }
+}
+
+// Ensure that a batch reports cyclic dependencies.
+TEST(include, case9) {
+    bool error_thrown = false;
+    try {
+        glsl_include include;
+        include.add("base.frag", file_to_str("case4/base.frag"));
+        include.add("incl0.frag", file_to_str("case4/incl0.frag"));
+        include.add("incl1.frag", file_to_str("case4/incl1.frag"));
+        include.add("incl2.frag", file_to_str("case4/incl2.frag"));
+        include.merge_batch({"incl2.frag", "base.frag"});
+    } catch (const std::exception &e) {
+        EXPECT_TRUE(e.what() == std::string{"glsl_include - Cyclic dependency detected."});
+        error_thrown = true;
+    }
+    EXPECT_TRUE(error_thrown);
+}
+
+// Ensure that a cancelled merge throws, and that an uncancelled token does not affect the merge.
+TEST(include, case10) {
+    glsl_include include;
+    include.add("base.frag", file_to_str("case0/base.frag"));
+    include.add("incl0.frag", file_to_str("case0/incl0.frag"));
+    include.add("incl1.frag", file_to_str("case0/incl1.frag"));
+    include.add("incl2.frag", file_to_str("case0/incl2.frag"));
+    include.add("incl3.frag", file_to_str("case0/incl3.frag"));
+
+    cancel_token token;
+    EXPECT_TRUE(include.merge(token) == file_to_str("case0/result.frag"));
+    EXPECT_TRUE(include.merge("base.frag", token) == file_to_str("case0/result.frag"));
+
+    token.cancel();
+    EXPECT_THROW(include.merge(token), merge_cancelled);
+    EXPECT_THROW(include.merge("base.frag", token), merge_cancelled);
+    EXPECT_THROW(include.merge_batch({"base.frag", "incl0.frag"}, token), merge_cancelled);
+}
+
+// Ensure that semantic hashes ignore comments and insignificant whitespace, but not code or preprocessor line breaks.
+TEST(include, case11) {
+    glsl_include include;
+    include.add("a.frag", "#define F(x) x\nvoid a() { return F(1) + 2; }");
+    include.add("b.frag", "// Comment.\n#define  F(x)  x /* Comment. */\n\n  void a()\n{\n    return F( 1 )+2;  // Comment.\n}\n");
+    include.add("c.frag", "#define F (x) x\nvoid a() { return F(1) + 2; }");
+    include.add("d.frag", "#define F(x) x void a() { return F(1) + 2; }");
+    include.add("e.frag", "#define F(x) x\nvoid a() { return F(1) + 3; }");
+    include.add("f.frag", "#define F(x) x\nvoida() { return F(1) + 2; }");
+
+    EXPECT_TRUE(include.semantic_hash("a.frag") == include.semantic_hash("b.frag"));
+    EXPECT_TRUE(include.semantic_hash("a.frag") != include.semantic_hash("c.frag"));
+    EXPECT_TRUE(include.semantic_hash("a.frag") != include.semantic_hash("d.frag"));
+    EXPECT_TRUE(include.semantic_hash("a.frag") != include.semantic_hash("e.frag"));
+    EXPECT_TRUE(include.semantic_hash("a.frag") != include.semantic_hash("f.frag"));
+
+    include.add("g.frag", "a +\n+b");
+    include.add("h.frag", "a ++b");
+    include.add("i.frag", "a +\n  +b");
+    EXPECT_TRUE(include.semantic_hash("g.frag") != include.semantic_hash("h.frag"));
+    EXPECT_TRUE(include.semantic_hash("g.frag") == include.semantic_hash("i.frag"));
+}
+
+// Ensure that a root's fingerprint only changes when the semantic content of a source it reaches changes.
+TEST(include, case12) {
+    auto fingerprint = [](const std::string &_incl0, const std::string &_incl1) {
+        glsl_include include;
+        include.add("base.frag", "#include <incl0.frag>\n#include <incl1.frag>\nvoid main() {}");
+        include.add("incl0.frag", _incl0);
+        include.add("incl1.frag", _incl1);
+        include.add("other.frag", "void other() {}");
+        return include.fingerprint("base.frag");
+    };
+
+    const uint64_t original = fingerprint("void incl0() {}", "void incl1() {}");
+    EXPECT_TRUE(original == fingerprint("// Edited.\nvoid incl0()\n{\n}", "void incl1() {}"));
+    EXPECT_TRUE(original != fingerprint("void incl0() { discard; }", "void incl1() {}"));
+    EXPECT_TRUE(original != fingerprint("void incl1() {}", "void incl0() {}"));
+}
+
+// Ensure that remerging reports unchanged roots, and skips assembly when no contributing segment changed.
+TEST(include, case13) {
+    glsl_include include;
+    include.add("base.frag", "#include <incl0.frag>\n#include <incl1.frag>\nvoid main() {}");
+    include.add("incl0.frag", "#include <incl1.frag>\nvoid incl0() {}");
+    include.add("incl1.frag", "void incl1() {}");
+
+    std::string out;
+    auto result = include.remerge("base.frag", out);
+    EXPECT_TRUE(result.changed && result.assembled);
+    EXPECT_TRUE(out == "void incl1() {}\nvoid incl0() {}\nvoid main() {}");
+    EXPECT_TRUE(result.length == out.size());
+
+    // Nothing changed, so nothing is assembled.
+    out.clear();
+    result = include.remerge("base.frag", out);
+    EXPECT_TRUE(!result.changed && !result.assembled && out.empty());
+
+    // The duplicate include of incl1.frag is erased, so the output does not change.
+    include.remove("incl0.frag");
+    include.add("incl0.frag", "#include <incl1.frag>\n#include <incl1.frag>\nvoid incl0() {}");
+    result = include.remerge("base.frag", out);
+    EXPECT_TRUE(!result.changed && result.assembled);
+
+    include.remove("incl1.frag");
+    include.add("incl1.frag", "void incl1() { discard; }");
+    result = include.remerge("base.frag", out);
+    EXPECT_TRUE(result.changed && result.assembled);
+    EXPECT_TRUE(out == "void incl1() { discard; }\nvoid incl0() {}\nvoid main() {}");
+}
+
+// Ensure that the cache of merged outputs stays within its budget, evicts the least recently used output,
+// and drops the outputs of roots which reach a removed source.
+TEST(include, case14) {
+    glsl_include include;
+    include.add("a.frag", "#include <common.frag>\nvoid a() {}");
+    include.add("b.frag", "#include <common.frag>\nvoid b() {}");
+    include.add("c.frag", "void c() {}");
+    include.add("common.frag", "void common() {}");
+    include.set_cache_budget(100);
+
+    EXPECT_TRUE(include.merge("a.frag") == "void common() {}\nvoid a() {}");
+    EXPECT_TRUE(include.merge("b.frag") == "void common() {}\nvoid b() {}");
+    EXPECT_TRUE(include.merge("a.frag") == "void common() {}\nvoid a() {}");
+    auto stats = include.cache_statistics();
+    EXPECT_TRUE(stats.hits == 1 && stats.misses == 2 && stats.entries == 2);
+    EXPECT_TRUE(stats.bytes <= stats.budget);
+
+    // b.frag is the least recently used, so it is evicted to make room for c.frag.
+    EXPECT_TRUE(include.merge("c.frag") == "void c() {}");
+    stats = include.cache_statistics();
+    EXPECT_TRUE(stats.evictions == 1 && stats.entries == 2 && stats.bytes <= stats.budget);
+    include.merge("a.frag");
+    EXPECT_TRUE(include.cache_statistics().hits == 2);
+
+    // Both cached roots which reach common.frag are dropped when it is replaced.
+    include.merge("b.frag");
+    include.remove("common.frag");
+    include.add("common.frag", "void common() { discard; }");
+    stats = include.cache_statistics();
+    EXPECT_TRUE(stats.invalidations == 2 && stats.entries == 0);
+    EXPECT_TRUE(include.merge("a.frag") == "void common() { discard; }\nvoid a() {}");
+
+    include.set_cache_budget(0);
+    EXPECT_TRUE(include.cache_statistics().entries == 0 && include.cache_statistics().bytes == 0);
+}
+
+// Ensure that memory is accounted to the right category, and released when sources are removed.
+TEST(include, case15) {
+    glsl_include include;
+    EXPECT_TRUE(include.memory().sources == 0 && include.memory().metadata == 0 && include.memory().caches == 0);
+
+    const std::string body(1000, ' ');
+    include.add("material_base.frag", "#include <material_incl0.frag>\nvoid main() {}" + body);
+    include.add("material_incl0.frag", "void incl0() {}" + body);
+    auto usage = include.memory();
+    EXPECT_TRUE(usage.sources >= 2 * body.size() && usage.names != 0 && usage.graph != 0);
+    EXPECT_TRUE(usage.metadata == 0 && usage.caches == 0);
+
+    // Analysis and line tables are metadata, and cached outputs are caches.
+    include.set_cache_budget(1 << 20);
+    include.merge("material_base.frag");
+    include.lines("material_base.frag");
+    usage = include.memory();
+    EXPECT_TRUE(usage.metadata != 0 && usage.caches >= 2 * body.size());
+
+    // A copy shares the sources and names, which stay counted by the original until the copy lets go of them.
+    {
+        glsl_include copy = include;
+        EXPECT_TRUE(copy.memory().sources == 0 && copy.memory().names == 0 && copy.memory().caches >= 2 * body.size());
+        include.remove("material_incl0.frag");
+        include.remove("material_base.frag");
+        EXPECT_TRUE(include.memory().sources == usage.sources);
+        EXPECT_TRUE(copy.merge("material_base.frag") == "void incl0() {}" + body + "\nvoid main() {}" + body);
+    }
+    include.set_cache_budget(0);
+    usage = include.memory();
+    EXPECT_TRUE(usage.sources == 0 && usage.names == 0 && usage.metadata == 0 && usage.caches < body.size());
+}
+
+// Ensure that a transaction applies all of its changes at once, or none of them if the result is invalid.
+TEST(include, case16) {
+    glsl_include include;
+    include.add("a.frag", "#include <common.frag>\nvoid a() {}");
+    include.add("b.frag", "void b() {}");
+    include.add("common.frag", "void common() {}");
+    include.set_cache_budget(1 << 20);
+    include.merge("a.frag");
+    include.merge("b.frag");
+
+    auto update = include.begin_update();
+    update.add("common.frag", "#include <util.frag>\nvoid common() { discard; }");
+    update.add("util.frag", "void util() {}");
+    update.remove("b.frag");
+    EXPECT_TRUE(update.size() == 3);
+    update.commit();
+    EXPECT_TRUE(update.size() == 0);
+    EXPECT_TRUE(include.cache_statistics().invalidations == 2 && include.cache_statistics().entries == 0);
+    EXPECT_TRUE(include.merge("a.frag") == "void util() {}\nvoid common() { discard; }\nvoid a() {}");
+    EXPECT_TRUE(include.merge() == "void util() {}\nvoid common() { discard; }\nvoid a() {}");
+
+    // A cycle rolls back the whole transaction.
+    update.add("util.frag", "#include <common.frag>\nvoid util() {}");
+    update.add("c.frag", "void c() {}");
+    bool thrown = false;
+    try {
+        update.commit();
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown && update.size() == 2);
+    EXPECT_TRUE(include.merge() == "void util() {}\nvoid common() { discard; }\nvoid a() {}");
+
+    // So does removing a source which is still included.
+    auto missing = include.begin_update();
+    missing.remove("util.frag");
+    thrown = false;
+    try {
+        missing.commit();
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+    EXPECT_TRUE(include.merge("a.frag") == "void util() {}\nvoid common() { discard; }\nvoid a() {}");
+}
+
+// Ensure that a large transaction, which is scanned in parallel, gives the same outputs as adding each source.
+TEST(include, case17) {
+    glsl_include expected;
+    glsl_include include;
+    auto update = include.begin_update();
+    std::vector<std::string> roots;
+    for (int i = 0; i < 200; ++i) {
+        const std::string name = "src" + std::to_string(i) + ".frag";
+        std::string source = "void f" + std::to_string(i) + "() {}";
+        if (i != 0) { source = "#include <src" + std::to_string(i / 2) + ".frag>\n" + source; }
+        expected.add(name, source);
+        update.add(name, source);
+        roots.push_back(name);
+    }
+    update.commit();
+    EXPECT_TRUE(include.merge_batch(roots) == expected.merge_batch(roots));
+}
+
+// Ensure that add() replaces an existing source, and that patching a source in place gives the same results as adding the patched text.
+TEST(include, case18) {
+    glsl_include include;
+    include.add("base.frag", "void main() {}");
+    include.add("base.frag", "#include <incl0.frag>\nvoid main() {}");
+    include.add("incl0.frag", "void incl0() {}");
+    include.add("incl1.frag", "void incl1() {}");
+    EXPECT_TRUE(include.merge("base.frag") == "void incl0() {}\nvoid main() {}");
+
+    const std::vector<std::string> snippets = {"\n", "#include <incl1.frag>\n", "#include <incl0.frag>", "  #inc", "lude <incl1.frag>",
+                                               "// x\n", "x", "<", ">", "  "};
+    std::mt19937 rng{1234};
+    std::string text = "#include <incl0.frag>\nvoid main() {}";
+    std::string before = include.merge("base.frag");
+    include.remerge("base.frag", before);
+    for (int i = 0; i < 500; ++i) {
+        const size_t offset = std::uniform_int_distribution<size_t>{0, text.size()}(rng);
+        const size_t erase = std::uniform_int_distribution<size_t>{0, 4}(rng);
+        const std::string &insert = snippets[std::uniform_int_distribution<size_t>{0, snippets.size() - 1}(rng)];
+        text.replace(offset, std::min(erase, text.size() - offset), insert);
+        include.update("base.frag", offset, erase, insert);
+
+        glsl_include expected;
+        expected.add("base.frag", text);
+        expected.add("incl0.frag", "void incl0() {}");
+        expected.add("incl1.frag", "void incl1() {}");
+        const std::string merged = expected.merge("base.frag");
+        std::string after;
+        const auto result = include.remerge("base.frag", after);
+        EXPECT_TRUE(result.changed == (merged != before));
+        EXPECT_TRUE(!result.assembled || after == merged);
+        EXPECT_TRUE(include.merge("base.frag") == merged);
+        before = merged;
+    }
+}
+
+// Ensure that directives in block comments and `#if 0` groups are skipped,
+// and that relexing only the edited lines gives the same results as scanning the whole source.
+TEST(include, case19) {
+    glsl_include include;
+    include.add("base.frag", "/* #include <incl0.frag>\n#include <incl0.frag> */\n#if 0\n#include <incl0.frag>\n#endif\n#include <incl1.frag>\nvoid main() {}");
+    include.add("incl0.frag", "void incl0() {}");
+    include.add("incl1.frag", "void incl1() {}");
+    EXPECT_TRUE(include.merge("base.frag") == "/* #include <incl0.frag>\n#include <incl0.frag> */\n#if 0\n#include <incl0.frag>\n#endif\nvoid incl1() {}\nvoid main() {}");
+
+    const std::vector<std::string> snippets = {"\n", "#include <incl1.frag>\n", "#include <incl0.frag>\n", "/*", "*/", "// x\n",
+                                               "#if 0\n", "#ifdef X\n", "#else\n", "#endif\n", "x", "  "};
+    std::mt19937 rng{5678};
+    std::string text = "#include <incl0.frag>\nvoid main() {}";
+    include.add("base.frag", text);
+    std::string before = include.merge("base.frag");
+    include.remerge("base.frag", before);
+    for (int i = 0; i < 1000; ++i) {
+        const size_t offset = std::uniform_int_distribution<size_t>{0, text.size()}(rng);
+        const size_t erase = std::uniform_int_distribution<size_t>{0, 6}(rng);
+        const std::string &insert = snippets[std::uniform_int_distribution<size_t>{0, snippets.size() - 1}(rng)];
+        text.replace(offset, std::min(erase, text.size() - offset), insert);
+        include.update("base.frag", offset, erase, insert);
+
+        glsl_include expected;
+        expected.add("base.frag", text);
+        expected.add("incl0.frag", "void incl0() {}");
+        expected.add("incl1.frag", "void incl1() {}");
+        const std::string merged = expected.merge("base.frag");
+        std::string after;
+        const auto result = include.remerge("base.frag", after);
+        EXPECT_TRUE(result.changed == (merged != before));
+        EXPECT_TRUE(include.merge("base.frag") == merged);
+        before = merged;
+    }
+}
+
+// Ensure that sources can be analysed when they are added, and that merges then give the same results.
+TEST(include, case20) {
+    glsl_include include;
+    include.set_analysis_policy(analysis_policy::on_add);
+    include.add("base.frag", "#include <incl0.frag>\nvoid main() {}");
+    EXPECT_TRUE(include.memory().metadata != 0);
+    include.add("incl0.frag", "void incl0() {}");
+    EXPECT_TRUE(include.content_hash("incl0.frag") == hasher::of("void incl0() {}"));
+    EXPECT_TRUE(include.merge() == "void incl0() {}\nvoid main() {}");
+    EXPECT_TRUE(include.merge("base.frag") == "void incl0() {}\nvoid main() {}");
+
+    include.update("incl0.frag", 5, 5, "incl1");
+    EXPECT_TRUE(include.content_hash("incl0.frag") == hasher::of("void incl1() {}"));
+    EXPECT_TRUE(include.merge() == "void incl1() {}\nvoid main() {}");
+}
+
+// Ensure that sources analysed in the background merge the same as sources analysed on merge,
+// even when they are merged, changed or removed before their analysis has run.
+TEST(include, case21) {
+    glsl_include expected;
+    glsl_include include;
+    include.set_analysis_policy(analysis_policy::background);
+    std::vector<std::string> roots;
+    for (int i = 0; i < 300; ++i) {
+        const std::string name = "src" + std::to_string(i) + ".frag";
+        std::string source = "void f" + std::to_string(i) + "() {}\n" + std::string(static_cast<size_t>(i) * 10, ' ');
+        if (i != 0) { source = "#include <src" + std::to_string(i / 2) + ".frag>\n" + source; }
+        expected.add(name, source);
+        include.add(name, source);
+        roots.push_back(name);
+    }
+    EXPECT_TRUE(include.merge("src299.frag") == expected.merge("src299.frag"));
+
+    include.update("src298.frag", 0, 0, "// x\n");
+    expected.update("src298.frag", 0, 0, "// x\n");
+    include.add("src297.frag", "void f297() {}");
+    expected.add("src297.frag", "void f297() {}");
+    include.remove("src296.frag");
+    expected.remove("src296.frag");
+    roots.erase(std::find(roots.begin(), roots.end(), "src296.frag"));
+    EXPECT_TRUE(include.merge_batch(roots) == expected.merge_batch(roots));
+    EXPECT_TRUE(include.content_hash("src297.frag") == hasher::of("void f297() {}"));
+
+    // Destroying the glsl_include drops the analyses which have not run.
+    glsl_include dropped;
+    dropped.set_analysis_policy(analysis_policy::background);
+    for (int i = 0; i < 300; ++i) { dropped.add("src" + std::to_string(i) + ".frag", std::string(10000, ' ')); }
+}
+
+// Ensure that shared outputs are served from the cache without copying, and that plain merges are unaffected by them.
+TEST(include, case22) {
+    glsl_include include;
+    include.add("base.frag", "#include <incl0.frag>\nvoid main() {}");
+    include.add("incl0.frag", "void incl0() {}");
+
+    auto shared = include.merge_shared("base.frag");
+    EXPECT_TRUE(*shared == "void incl0() {}\nvoid main() {}" && shared.use_count() == 1);
+    EXPECT_TRUE(include.merge_shared("base.frag") != shared);
+
+    include.set_cache_budget(1 << 20);
+    shared = include.merge_shared("base.frag");
+    EXPECT_TRUE(include.merge_shared("base.frag") == shared);
+    EXPECT_TRUE(include.merge("base.frag") == *shared);
+    EXPECT_TRUE(include.memory().caches >= shared->size());
+
+    // The cache drops its share, but the consumer's share stays valid.
+    include.remove("incl0.frag");
+    EXPECT_TRUE(shared.use_count() == 1 && *shared == "void incl0() {}\nvoid main() {}");
+}
+
+// Ensure that a shared source is added to other glsl_includes without copying it, and is copied before it is changed.
+TEST(include, case23) {
+    const std::string library = "#include <noise.glsl>\nfloat common() { return 1.0; }" + std::string(1000, ' ');
+    glsl_include materials;
+    materials.add("common.glsl", library);
+    materials.add("noise.glsl", "float noise() { return 0.5; }");
+    materials.add("base.frag", "#include <common.glsl>\nvoid main() {}");
+
+    glsl_include post;
+    post.add("common.glsl", materials.share("common.glsl"));
+    post.add("noise.glsl", materials.share("noise.glsl"));
+    post.add("post.frag", "#include <common.glsl>\nvoid post() {}");
+    EXPECT_TRUE(materials.share("common.glsl") == post.share("common.glsl"));
+    EXPECT_TRUE(post.memory().sources < library.size() && post.memory().metadata == 0);
+    EXPECT_TRUE(post.merge("post.frag") == "float noise() { return 0.5; }\nfloat common() { return 1.0; }" + std::string(1000, ' ') + "\nvoid post() {}");
+
+    // Updating the source in one glsl_include leaves the other untouched.
+    post.update("common.glsl", library.find("1.0"), 3, "2.0");
+    EXPECT_TRUE(materials.share("common.glsl") != post.share("common.glsl"));
+    EXPECT_TRUE(post.memory().sources >= library.size());
+    EXPECT_TRUE(post.merge("post.frag").find("return 2.0;") != std::string::npos);
+    EXPECT_TRUE(materials.merge("base.frag").find("return 1.0;") != std::string::npos);
+}
+
+// Ensure that a fork shares the sources and cached outputs of its parent, and that overrides in either one stay apart.
+TEST(include, case24) {
+    const std::string body(1000, ' ');
+    glsl_include base;
+    base.set_cache_budget(1 << 20);
+    base.add("material_lighting.glsl", "float lighting() { return 1.0; }" + body);
+    base.add("material_albedo.glsl", "vec3 albedo() { return vec3(1.0); }");
+    base.add("material_opaque.frag", "#include <material_lighting.glsl>\nvoid opaque() {}");
+    base.add("material_tinted.frag", "#include <material_albedo.glsl>\n#include <material_lighting.glsl>\nvoid tinted() {}");
+    const std::string opaque = base.merge("material_opaque.frag");
+    const std::string tinted = base.merge("material_tinted.frag");
+
+    glsl_include fork = base.fork();
+    EXPECT_TRUE(fork.memory().sources == 0 && fork.memory().names == 0 && fork.memory().graph == 0);
+
+    // Only the override takes memory, and only the roots which reach it are merged again.
+    fork.add("material_albedo.glsl", "vec3 albedo() { return vec3(0.5); }");
+    EXPECT_TRUE(fork.memory().sources < body.size());
+    EXPECT_TRUE(fork.cache_statistics().entries == 1);
+    EXPECT_TRUE(fork.merge("material_opaque.frag") == opaque && fork.cache_statistics().hits == 1);
+    EXPECT_TRUE(fork.merge("material_tinted.frag") == "vec3 albedo() { return vec3(0.5); }\nfloat lighting() { return 1.0; }" + body + "\nvoid tinted() {}");
+    EXPECT_TRUE(base.merge("material_tinted.frag") == tinted);
+
+    // Updating or removing a shared source in one of them leaves the other untouched.
+    base.update("material_lighting.glsl", 0, 5, "highp float");
+    fork.remove("material_opaque.frag");
+    EXPECT_TRUE(fork.merge("material_tinted.frag").find("highp") == std::string::npos);
+    EXPECT_TRUE(base.merge("material_opaque.frag").find("highp") != std::string::npos);
+    EXPECT_TRUE(fork.merge("material_tinted.frag").find("highp") == std::string::npos);
+}
+
+// Ensure that names resolve to the topmost layer which defines them, and that changing a layer only drops the outputs which reach it.
+TEST(include, case25) {
+    glsl_include engine;
+    engine.add("lighting.glsl", "float lighting() { return 1.0; }");
+    engine.add("fog.glsl", "float fog() { return 0.0; }");
+    engine.add("main.frag", "#include <lighting.glsl>\nvoid main() {}");
+    engine.add("post.frag", "#include <fog.glsl>\nvoid post() {}");
+    glsl_include project;
+    project.add("lighting.glsl", "float lighting() { return 2.0; }");
+
+    glsl_include game;
+    game.set_layer(1, project);
+    game.set_layer(0, engine);
+    EXPECT_TRUE(game.num_layers() == 2 && game.memory().sources == 0);
+    game.set_cache_budget(1 << 20);
+    EXPECT_TRUE(game.merge("main.frag") == "float lighting() { return 2.0; }\nvoid main() {}");
+    EXPECT_TRUE(game.merge("post.frag") == "float fog() { return 0.0; }\nvoid post() {}");
+
+    // Setting a changed layer again only drops the outputs which reach the changed source.
+    project.update("lighting.glsl", project.lines("lighting.glsl").line_end(0) - 6, 3, "3.0");
+    game.set_layer(1, project);
+    EXPECT_TRUE(game.cache_statistics().invalidations == 1 && game.cache_statistics().entries == 1);
+    EXPECT_TRUE(game.merge("main.frag") == "float lighting() { return 3.0; }\nvoid main() {}");
+
+    // A source changed in an unused layer, or hidden by a higher layer, drops nothing.
+    engine.update("lighting.glsl", 0, 5, "highp float");
+    game.set_layer(0, engine);
+    EXPECT_TRUE(game.cache_statistics().invalidations == 1);
+
+    // Sources added on top override every layer, and removing them reveals the layers again.
+    game.add("lighting.glsl", "float lighting() { return 4.0; }");
+    EXPECT_TRUE(game.cache_statistics().invalidations == 2 && game.merge("main.frag") == "float lighting() { return 4.0; }\nvoid main() {}");
+    game.remove("lighting.glsl");
+    EXPECT_TRUE(game.merge("main.frag") == "float lighting() { return 3.0; }\nvoid main() {}");
+    game.update("fog.glsl", 0, 5, "highp float");
+    EXPECT_TRUE(game.merge("post.frag") == "highp float fog() { return 0.0; }\nvoid post() {}");
+    EXPECT_TRUE(engine.merge("post.frag") == "float fog() { return 0.0; }\nvoid post() {}");
+}
+
+// Ensure that sources are removed by prefix or predicate in one batch, and that the roots they break are reported.
+TEST(include, case26) {
+    glsl_include include;
+    include.add("dlc_water.glsl", "float water() { return 1.0; }");
+    include.add("dlc_water.frag", "#include <dlc_water.glsl>\nvoid main() {}");
+    include.add("common.glsl", "#include <dlc_water.glsl>\nfloat common() { return 0.0; }");
+    include.add("ocean.frag", "#include <common.glsl>\nvoid ocean() {}");
+    include.add("lake.frag", "#include <dlc_water.glsl>\nvoid lake() {}");
+    include.add("sky.frag", "void sky() {}");
+    include.add("sky.tmp", "void sky_tmp() {}");
+    include.set_cache_budget(1 << 20);
+    include.merge_batch({"ocean.frag", "sky.frag"});
+
+    EXPECT_TRUE(include.remove_prefix("dlc_") == std::vector<std::string>({"lake.frag", "ocean.frag"}));
+    EXPECT_TRUE(include.cache_statistics().invalidations == 1 && include.cache_statistics().entries == 1);
+    EXPECT_TRUE(include.merge("sky.frag") == "void sky() {}");
+
+    EXPECT_TRUE(include.remove_if([](std::string_view _name) { return _name.ends_with(".tmp"); }).empty());
+    EXPECT_TRUE(include.remove_prefix("dlc_").empty());
+    include.add("dlc_water.glsl", "float water() { return 2.0; }");
+    EXPECT_TRUE(include.merge("lake.frag") == "float water() { return 2.0; }\nvoid lake() {}");
+}
+
+// Ensure that the graph passes of merge() agree with merging the root, and still find cycles, on a large graph.
+TEST(include, case27) {
+    const size_t n = 10000;
+    glsl_include include;
+    for (size_t i = 0; i < n; ++i) {
+        std::string source;
+        for (size_t incl : {2 * i + 1, 2 * i + 2, i + 7}) {
+            if (incl < n) { source += "#include <node" + std::to_string(incl) + ".glsl>\n"; }
+        }
+        include.add("node" + std::to_string(i) + ".glsl", source + "float f" + std::to_string(i) + "();");
+    }
+    const std::string merged = include.merge();
+    EXPECT_TRUE(merged == include.merge("node0.glsl"));
+    EXPECT_TRUE(merged.find("float f0();") == merged.size() - 11 && merged.find("float f9999();") != std::string::npos);
+
+    include.update("node9999.glsl", 0, 0, "#include <node4999.glsl>\n");
+    bool thrown = false;
+    try {
+        include.merge();
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+// Ensure that sources read from files in chunks merge and hash like sources in memory, whatever the chunk size.
+TEST(include, case28) {
+    const std::filesystem::path table = std::filesystem::temp_directory_path() / "mkr_glsl_include_case28.glsl";
+    std::string text = "/* A generated table.\n#include <incl0.frag>\n*/\n";
+    for (int i = 0; i < 200; ++i) { text += "    " + std::to_string(i) + ".0, // Row " + std::to_string(i) + "\n"; }
+    text += "  #include <incl1.frag>  // Spliced.\n#if 0\n#include <missing.frag>\n#endif\nconst float last = 1.0;";
+    std::ofstream{table, std::ios::binary} << text;
+
+    glsl_include memory;
+    for (const char *name : {"base.frag", "incl0.frag", "incl1.frag", "incl2.frag", "incl3.frag"}) {
+        memory.add(name, file_to_str(std::string{"case0/"} + name));
+    }
+    memory.add("table.glsl", text);
+
+    for (size_t chunk_size : {size_t{1}, size_t{2}, size_t{3}, size_t{7}, size_t{64}, default_chunk_size}) {
+        glsl_include files;
+        for (const char *name : {"base.frag", "incl0.frag", "incl1.frag", "incl2.frag", "incl3.frag"}) {
+            files.add_file(name, std::string{"case0/"} + name, chunk_size);
+        }
+        EXPECT_TRUE(files.merge() == file_to_str("case0/result.frag"));
+
+        files.add_file("table.glsl", table, chunk_size);
+        EXPECT_TRUE(files.merge("table.glsl") == memory.merge("table.glsl"));
+        EXPECT_TRUE(files.content_hash("table.glsl") == memory.content_hash("table.glsl"));
+        EXPECT_TRUE(files.semantic_hash("table.glsl") == memory.semantic_hash("table.glsl"));
+        EXPECT_TRUE(files.lines("table.glsl").starts() == memory.lines("table.glsl").starts());
+
+        std::string merged;
+        EXPECT_TRUE(files.remerge("table.glsl", merged).hash == memory.remerge("table.glsl", merged).hash);
+        files.update("table.glsl", 0, 2, "//"); // Loads the source into memory.
+        EXPECT_TRUE(files.merge("table.glsl").starts_with("//"));
+    }
+
+    glsl_include files;
+    files.add_file("table.glsl", table);
+    std::ofstream{table, std::ios::binary} << "void main() {}";
+    bool changed_thrown = false;
+    try {
+        files.merge("table.glsl");
+    } catch (const std::runtime_error &) {
+        changed_thrown = true;
+    }
+    EXPECT_TRUE(changed_thrown);
+
+    std::filesystem::remove(table);
+    bool missing_thrown = false;
+    try {
+        files.add_file("table.glsl", table);
+    } catch (const std::runtime_error &) {
+        missing_thrown = true;
+    }
+    EXPECT_TRUE(missing_thrown);
+}
+
+// Ensure that merging into a sink gives the same bytes as merge(), in pieces which fit the window unless a single piece is larger.
+TEST(include, case29) {
+    glsl_include include;
+    for (const char *name : {"base.frag", "incl0.frag", "incl1.frag", "incl2.frag", "incl3.frag"}) {
+        include.add_file(name, std::string{"case0/"} + name, 5);
+    }
+    include.add("long.frag", std::string(1000, 'x') + "\n#include <base.frag>\n#include <incl0.frag>\nvoid main() {}");
+
+    for (size_t window : {size_t{0}, size_t{16}, size_t{256}, default_chunk_size}) {
+        std::string merged;
+        size_t largest = 0;
+        const uint64_t length = include.merge_to("long.frag", [&](std::string_view _piece) {
+            merged += _piece;
+            largest = std::max(largest, _piece.size());
+        }, window);
+        EXPECT_TRUE(merged == include.merge("long.frag") && length == merged.size());
+        EXPECT_TRUE(largest <= std::max<size_t>(window, 1001));
+    }
+
+    std::ostringstream stream;
+    EXPECT_TRUE(include.merge_to("base.frag", stream) == stream.str().size());
+    EXPECT_TRUE(stream.str() == file_to_str("case0/result.frag"));
+
+    const std::filesystem::path path = std::filesystem::temp_directory_path() / "mkr_glsl_include_case29.frag";
+    include.merge_to("base.frag", path);
+    EXPECT_TRUE(file_to_str(path.string()) == file_to_str("case0/result.frag"));
+    std::filesystem::remove(path);
+
+    include.add("incl3.frag", "#include <base.frag>\n");
+    bool cycle_thrown = false;
+    try {
+        include.merge_to("base.frag", [](std::string_view) {});
+    } catch (const std::runtime_error &) {
+        cycle_thrown = true;
+    }
+    EXPECT_TRUE(cycle_thrown);
+
+    cancel_token token;
+    token.cancel();
+    bool cancel_thrown = false;
+    try {
+        include.merge_to("long.frag", [](std::string_view) {}, token);
+    } catch (const merge_cancelled &) {
+        cancel_thrown = true;
+    }
+    EXPECT_TRUE(cancel_thrown);
+}
+
+// Ensure that an incremental merge resumes where it stopped, and gives the same bytes as merge() however it is sliced.
+TEST(include, case30) {
+    glsl_include include;
+    for (const char *name : {"base.frag", "incl0.frag", "incl1.frag", "incl2.frag", "incl3.frag"}) {
+        include.add(name, file_to_str(std::string{"case0/"} + name));
+    }
+    include.add_file("table.glsl", "case0/incl2.frag", 3);
+    include.add("big.frag", "#include <base.frag>\n" + std::string(3 * default_chunk_size, 'x') + "\n#include <table.glsl>\n");
+
+    auto merge = include.begin_merge("big.frag");
+    EXPECT_TRUE(!merge.done() && merge.output().empty());
+    size_t steps = 0;
+    while (!merge.step(0)) { ++steps; }
+    EXPECT_TRUE(steps > 3 && merge.done());
+    EXPECT_TRUE(merge.take() == include.merge("big.frag"));
+
+    auto whole = include.begin_merge("base.frag");
+    while (!whole.step(1000000)) {}
+    EXPECT_TRUE(whole.output() == file_to_str("case0/result.frag"));
+
+    include.add("incl3.frag", "#include <big.frag>\n");
+    auto cyclic = include.begin_merge("big.frag");
+    bool thrown = false;
+    try {
+        while (!cyclic.step(0)) {}
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+// Ensure that the chunks of a merge are produced lazily, fit the maximum size, and join up to the output of merge().
+TEST(include, case31) {
+    static_assert(std::ranges::input_range<glsl_include::chunk_sequence>);
+    glsl_include include;
+    for (const char *name : {"base.frag", "incl0.frag", "incl1.frag", "incl2.frag", "incl3.frag"}) {
+        include.add_file(name, std::string{"case0/"} + name, 4);
+    }
+
+    for (size_t max_chunk : {size_t{1}, size_t{8}, default_chunk_size}) {
+        std::string merged;
+        hasher hash;
+        for (std::string_view chunk : include.merge_chunks("base.frag", max_chunk)) {
+            EXPECT_TRUE(!chunk.empty() && chunk.size() <= max_chunk);
+            merged += chunk;
+            hash.update(chunk);
+        }
+        EXPECT_TRUE(merged == file_to_str("case0/result.frag"));
+        EXPECT_TRUE(hash.digest() == hasher::of(merged));
+    }
+
+    // Nothing is merged until the chunks are pulled, so a cyclic dependency is only found then.
+    include.add("incl3.frag", "#include <base.frag>\n");
+    auto chunks = include.merge_chunks("base.frag");
+    bool thrown = false;
+    try {
+        for (std::string_view chunk : chunks) { static_cast<void>(chunk); }
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+
+    // The root is not analysed until then either, so an include of a missing source is only found then too.
+    include.add("missing.frag", "#include <incl4.frag>\nvoid main() {}");
+    auto missing = include.merge_chunks("missing.frag");
+    thrown = false;
+    try {
+        static_cast<void>(missing.begin());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+// Ensure that erasing a duplicate include only erases its line, so the blank lines after it are kept.
+TEST(include, case32) {
+    glsl_include include;
+    include.add("a.frag", "void a() {}");
+    include.add("b.frag", "#include <a.frag>   \n\n\nvoid b() {}");
+    include.add("main.frag", "#include <a.frag>\n#include <b.frag>\nvoid main() {}");
+    EXPECT_TRUE(include.merge("main.frag") == "void a() {}\n\n\nvoid b() {}\nvoid main() {}");
+    EXPECT_TRUE(include.merge() == include.merge("main.frag"));
+}
+
+// Ensure that a deep chain of includes merges without overflowing the call stack.
+TEST(include, case33) {
+    const size_t n = 100000;
+    glsl_include include;
+    for (size_t i = 0; i < n; ++i) {
+        const std::string incl = i + 1 < n ? "#include <n" + std::to_string(i + 1) + ">\n" : "";
+        include.add("n" + std::to_string(i), incl + "float f" + std::to_string(i) + "();\n");
+    }
+    const std::string merged = include.merge();
+    EXPECT_TRUE(merged == include.merge("n0"));
+    EXPECT_TRUE(merged.starts_with("float f99999();\n\nfloat f99998();\n\n") && merged.ends_with("\nfloat f0();\n"));
+    EXPECT_TRUE(include.fingerprint("n0") != include.fingerprint("n1"));
+
+    std::string remerged;
+    EXPECT_TRUE(include.remerge("n0", remerged).changed && remerged == merged);
+    EXPECT_TRUE(!include.remerge("n0", remerged).assembled);
+}
+
+// Ensure that a transaction which reaches an include of a missing source through an unchanged source throws, and changes nothing.
+TEST(include, case34) {
+    glsl_include include;
+    include.add("other.frag", "#include <missing.frag>\nvoid other() {}");
+
+    auto update = include.begin_update();
+    update.add("a.frag", "#include <other.frag>\nvoid a() {}");
+    std::string what;
+    try {
+        update.commit();
+    } catch (const std::runtime_error &_e) {
+        what = _e.what();
+    }
+    EXPECT_TRUE(what == "glsl_include - Cannot include missing source missing.frag.");
+    EXPECT_TRUE(update.size() == 1);
+}
+
+// Ensure that removing a source only rejects the includes of the removed source, and not sources which were already broken.
+TEST(include, case35) {
+    glsl_include include;
+    include.add("broken.frag", "#include <missing.frag>\nvoid broken() {}");
+    include.add("old.frag", "void old() {}");
+    include.add("a.frag", "void a() {}");
+
+    auto update = include.begin_update();
+    update.remove("old.frag");
+    update.commit();
+    EXPECT_TRUE(update.size() == 0);
+    EXPECT_TRUE(include.merge("a.frag") == "void a() {}");
+
+    include.add("b.frag", "#include <a.frag>\nvoid b() {}");
+    update.remove("a.frag");
+    bool thrown = false;
+    try {
+        update.commit();
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown && include.merge("b.frag") == "void a() {}\nvoid b() {}");
+}
+
+// Ensure that the passes over every source handle a deep graph and a wide graph of many sources.
+TEST(include, case36) {
+    glsl_include deep;
+    for (size_t i = 0; i < 10000; ++i) {
+        const std::string incl = i + 1 < 10000 ? "#include <n" + std::to_string(i + 1) + ">\n" : "";
+        deep.add("n" + std::to_string(i), incl + "float f" + std::to_string(i) + "();\n");
+    }
+    EXPECT_TRUE(deep.merge() == deep.merge("n0"));
+
+    glsl_include wide;
+    std::string root;
+    std::string expected;
+    for (size_t i = 0; i < 100000; ++i) {
+        const std::string text = "float f" + std::to_string(i) + "();\n";
+        wide.add("n" + std::to_string(i), text);
+        root += "#include <n" + std::to_string(i) + ">\n";
+        expected += text + "\n";
+    }
+    wide.add("main.frag", root + "void main() {}\n");
+    expected += "void main() {}\n";
+    EXPECT_TRUE(wide.merge() == expected && wide.merge("main.frag") == expected);
+
+    // Both searches for the roots which a removal breaks cross the whole graph.
+    EXPECT_TRUE(deep.remove_if([](std::string_view _name) { return _name == "n9999"; }) == std::vector<std::string>{"n0"});
+    EXPECT_TRUE(wide.remove_if([](std::string_view _name) { return _name == "n99999"; }) == std::vector<std::string>{"main.frag"});
+}
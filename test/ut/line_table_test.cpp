@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <algorithm>
+#include "glsl_include.h"
+
+using namespace mkr;
+using namespace std;
+
+// Ensure that lines are found on either side of the vectorised and scalar scans.
+TEST(line_table, case0) {
+    std::string source;
+    for (size_t i = 0; i < 200; ++i) {
+        source += std::string(i % 37, 'x') + '\n';
+    }
+    source += "last line";
+
+    line_table lines(source);
+    EXPECT_TRUE(lines.num_lines() == 201);
+    for (size_t offset = 0; offset < source.size(); ++offset) {
+        const size_t expected = std::count(source.begin(), source.begin() + offset, '\n');
+        EXPECT_TRUE(lines.line_of(offset) == expected);
+    }
+    EXPECT_TRUE(source.substr(lines.line_begin(200), lines.line_end(200) - lines.line_begin(200)) == "last line");
+    EXPECT_TRUE(source.substr(lines.line_begin(3), lines.line_end(3) - lines.line_begin(3)) == "xxx");
+}
+
+// Ensure that a source without newlines has a single line.
+TEST(line_table, case1) {
+    line_table lines("void main() {}");
+    EXPECT_TRUE(lines.num_lines() == 1);
+    EXPECT_TRUE(lines.line_of(5) == 0);
+    EXPECT_TRUE(lines.line_end(0) == 14);
+
+    line_table empty("");
+    EXPECT_TRUE(empty.num_lines() == 1);
+}
+
+// Ensure that the line table of a source can be queried, and that missing sources throw.
+TEST(line_table, case2) {
+    glsl_include include;
+    include.add("base.frag", "#include <incl0.frag>\nvoid main() {\n}");
+    EXPECT_TRUE(include.lines("base.frag").num_lines() == 3);
+    EXPECT_TRUE(include.lines("base.frag").line_of(23) == 1);
+    EXPECT_TRUE(&include.lines("base.frag") == &include.lines("base.frag"));
+
+    bool error_thrown = false;
+    try {
+        include.lines("incl0.frag");
+    } catch (const std::exception &e) {
+        EXPECT_TRUE(e.what() == std::string{"glsl_include - Cannot find source incl0.frag."});
+        error_thrown = true;
+    }
+    EXPECT_TRUE(error_thrown);
+}
+
+// Ensure that appending a source chunk by chunk builds the same table as building it whole.
+TEST(line_table, case3) {
+    std::string source;
+    for (int i = 0; i < 300; ++i) { source += std::string(i % 37, 'x') + "\n"; }
+    const line_table whole(source);
+    for (size_t chunk_size : {1, 5, 16, 33, 100}) {
+        line_table chunked{std::allocator<std::uint32_t>{}};
+        for (size_t pos = 0; pos < source.size(); pos += chunk_size) { chunked.append(std::string_view{source}.substr(pos, chunk_size)); }
+        EXPECT_TRUE(chunked.starts() == whole.starts());
+        EXPECT_TRUE(chunked.line_end(chunked.num_lines() - 1) == whole.line_end(whole.num_lines() - 1));
+    }
+}
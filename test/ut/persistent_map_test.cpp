@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+#include <map>
+#include <random>
+#include <string>
+#include "glsl_persistent_map.h"
+
+using namespace mkr;
+using namespace std;
+
+// Ensure that random inserts and erases match std::map, including keys whose hashes collide.
+TEST(persistent_map, case0) {
+    struct weak_hash {
+        size_t operator()(const std::string &_key) const { return std::hash<std::string>{}(_key) % 64; }
+    };
+    persistent_map<std::string, int, weak_hash> map;
+    std::map<std::string, int> expected;
+    std::mt19937 rng(7);
+    for (int i = 0; i < 5000; ++i) {
+        const std::string key = "key" + std::to_string(rng() % 500);
+        if (rng() % 3 == 0) {
+            EXPECT_TRUE(map.erase(key) == (expected.erase(key) == 1));
+        } else {
+            map.insert_or_assign(key, i);
+            expected[key] = i;
+        }
+    }
+    EXPECT_TRUE(map.size() == expected.size());
+    std::map<std::string, int> visited;
+    map.for_each([&](const std::string &_key, int _value) { visited.emplace(_key, _value); });
+    EXPECT_TRUE(visited == expected);
+}
+
+// Ensure that copies share their contents, and that changing one copy leaves the other untouched.
+TEST(persistent_map, case1) {
+    persistent_map<std::string, int> map;
+    for (int i = 0; i < 1000; ++i) { map.insert_or_assign(std::to_string(i), i); }
+    const int *shared = map.find(std::string{"7"});
+
+    persistent_map<std::string, int> copy = map;
+    EXPECT_TRUE(copy.find(std::string{"7"}) == shared);
+    *copy.find_mutable(std::string{"7"}) = -7;
+    copy.erase(std::string{"8"});
+    copy.insert_or_assign("1000", 1000);
+
+    EXPECT_TRUE(*map.find(std::string{"7"}) == 7 && map.contains(std::string{"8"}) && !map.contains(std::string{"1000"}));
+    EXPECT_TRUE(*copy.find(std::string{"7"}) == -7 && !copy.contains(std::string{"8"}) && copy.contains(std::string{"1000"}));
+    EXPECT_TRUE(map.size() == 1000 && copy.size() == 1000);
+    EXPECT_TRUE(map.find(std::string{"9"}) == copy.find(std::string{"9"}));
+}
+
+// Ensure that comparing two maps reports exactly the keys which were added, removed or replaced.
+TEST(persistent_map, case2) {
+    persistent_map<std::string, int> map;
+    for (int i = 0; i < 2000; ++i) { map.insert_or_assign(std::to_string(i), i); }
+    persistent_map<std::string, int> copy = map;
+    copy.erase(std::string{"5"});
+    copy.insert_or_assign("17", 17);
+    *copy.find_mutable(std::string{"42"}) = -42;
+    copy.insert_or_assign("2000", 2000);
+
+    std::map<std::string, std::pair<bool, bool>> changes;
+    persistent_map<std::string, int>::diff(map, copy, [&](const std::string &_key, const int *_old, const int *_new) {
+        changes.emplace(_key, std::make_pair(_old != nullptr, _new != nullptr));
+    });
+    const std::map<std::string, std::pair<bool, bool>> expected{
+        {"5", {true, false}}, {"17", {true, true}}, {"42", {true, true}}, {"2000", {false, true}}};
+    EXPECT_TRUE(changes == expected);
+}
@@ -0,0 +1,102 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "glsl_merge_scheduler.h"
+
+using namespace mkr;
+using namespace std;
+
+// Ensure that merges run on the worker thread and report their results and errors.
+TEST(scheduler, case0) {
+    glsl_include include;
+    include.add("base.frag", "#include <incl0.frag>\nvoid main() {}");
+    include.add("incl0.frag", "void incl0() {}");
+    include.add("broken.frag", "#include <missing.frag>");
+
+    merge_scheduler scheduler(include);
+    auto merged = scheduler.submit("base.frag", merge_priority::interactive);
+    auto broken = scheduler.submit("broken.frag", merge_priority::background);
+    EXPECT_TRUE(merged.get() == "void incl0() {}\nvoid main() {}");
+
+    bool error_thrown = false;
+    try {
+        broken.get();
+    } catch (const std::exception &e) {
+        EXPECT_TRUE(e.what() == std::string{"glsl_include - Cannot include missing source missing.frag."});
+        error_thrown = true;
+    }
+    EXPECT_TRUE(error_thrown);
+}
+
+// Ensure that queued tasks run in priority order, and that their latencies are recorded per priority class.
+TEST(scheduler, case1) {
+    glsl_include include;
+    include.add("base.frag", "void main() {}");
+
+    merge_scheduler scheduler(include);
+    std::promise<void> started, release;
+    auto blocker = scheduler.post([&started, gate = release.get_future().share()](glsl_include &) {
+        started.set_value();
+        gate.wait();
+    });
+    started.get_future().wait();
+
+    std::vector<std::string> order;
+    auto record = [&order](std::string _name) { return [&order, _name](glsl_include &) { order.push_back(_name); }; };
+    auto background = scheduler.post(record("background"), merge_priority::background);
+    auto normal = scheduler.post(record("normal"), merge_priority::normal);
+    auto interactive = scheduler.post(record("interactive"), merge_priority::interactive);
+    auto merged = scheduler.submit("base.frag", merge_priority::interactive);
+    EXPECT_TRUE(scheduler.pending(merge_priority::interactive) == 2);
+    EXPECT_TRUE(scheduler.pending(merge_priority::background) == 1);
+
+    release.set_value();
+    background.get();
+    EXPECT_TRUE(merged.get() == "void main() {}");
+    EXPECT_TRUE((order == std::vector<std::string>{"interactive", "normal", "background"}));
+
+    EXPECT_TRUE(scheduler.histogram(merge_priority::interactive).count() == 3);
+    EXPECT_TRUE(scheduler.histogram(merge_priority::normal).count() == 1);
+    EXPECT_TRUE(scheduler.histogram(merge_priority::background).count() == 1);
+}
+
+// Ensure that percentiles are bounded by their buckets.
+TEST(scheduler, case2) {
+    latency_histogram histogram;
+    for (uint64_t us = 1; us <= 100; ++us) { histogram.record(us); }
+    EXPECT_TRUE(histogram.count() == 100);
+    EXPECT_TRUE(histogram.max_us() == 100);
+    EXPECT_TRUE(histogram.bucket(0) == 1);
+    EXPECT_TRUE(histogram.bucket(6) == 37);
+    EXPECT_TRUE(histogram.percentile_us(0.5) == 63);
+    EXPECT_TRUE(histogram.percentile_us(1.0) == 100);
+    EXPECT_TRUE(histogram.mean_us() == 50.5);
+}
+
+// Ensure that a newer merge of a root drops the queued merges of that root, and keeps the highest priority.
+TEST(scheduler, case3) {
+    glsl_include include;
+    include.add("base.frag", "void main() {}");
+    include.add("other.frag", "void other() {}");
+
+    merge_scheduler scheduler(include);
+    std::promise<void> started, release;
+    auto blocker = scheduler.post([&started, gate = release.get_future().share()](glsl_include &) {
+        started.set_value();
+        gate.wait();
+    });
+    started.get_future().wait();
+
+    auto first = scheduler.submit_latest("base.frag", merge_priority::interactive);
+    auto other = scheduler.submit_latest("other.frag", merge_priority::background);
+    auto second = scheduler.submit_latest("base.frag", merge_priority::background);
+    auto latest = scheduler.submit_latest("base.frag", merge_priority::background);
+    EXPECT_TRUE(scheduler.pending(merge_priority::interactive) == 1);
+    EXPECT_TRUE(scheduler.pending(merge_priority::background) == 1);
+    EXPECT_THROW(first.get(), merge_cancelled);
+    EXPECT_THROW(second.get(), merge_cancelled);
+
+    release.set_value();
+    EXPECT_TRUE(latest.get() == "void main() {}");
+    EXPECT_TRUE(other.get() == "void other() {}");
+}
@@ -0,0 +1,54 @@
+#include <gtest/gtest.h>
+#include <string>
+#include "glsl_static_include.h"
+
+using namespace mkr;
+using namespace std;
+
+template<> struct mkr::shader_source<"base.frag"> {
+    static constexpr std::string_view source = "#include <incl0.frag>\n"
+                                               "#include <incl1.frag>\n"
+                                               "void main() {\n"
+                                               "}";
+};
+
+template<> struct mkr::shader_source<"incl0.frag"> {
+    static constexpr std::string_view source = "#include <incl1.frag>\n"
+                                               "incl0 line 0;";
+};
+
+template<> struct mkr::shader_source<"incl1.frag"> {
+    static constexpr std::string_view source = "    #include    <incl2.frag>\n"
+                                               "// #include <incl0.frag>\n"
+                                               "incl1 line 0;";
+};
+
+template<> struct mkr::shader_source<"incl2.frag"> {
+    static constexpr std::string_view source = "incl2 line 0;";
+};
+
+// Ensure that embedded sources are merged at compile time, with each source only included once.
+TEST(static_include, case0) {
+    constexpr std::string_view merged = static_merge_v<"base.frag">;
+    static_assert(merged == "incl2 line 0;\n"
+                            "// #include <incl0.frag>\n"
+                            "incl1 line 0;\n"
+                            "incl0 line 0;\n"
+                            "void main() {\n"
+                            "}");
+    EXPECT_TRUE(std::string{merged} == std::string{static_merge_v<"base.frag">});
+}
+
+// Ensure that any embedded source can be used as a root.
+TEST(static_include, case1) {
+    EXPECT_TRUE(static_merge_v<"incl1.frag"> == "incl2 line 0;\n// #include <incl0.frag>\nincl1 line 0;");
+    EXPECT_TRUE(static_merge_v<"incl2.frag"> == "incl2 line 0;");
+}
+
+// Ensure that compile-time merges skip directives in block comments and `#if 0` groups, like runtime merges.
+TEST(static_include, case2) {
+    constexpr std::string_view source = "/*\n#include <incl0.frag>\n*/\n#if 0\n#ifdef X\n#endif\n#include <incl1.frag>\n#else\n#include <incl2.frag>\n#endif";
+    static_assert(directive::count(source) == 1);
+    static_assert(directive::at(source, 0).name == "incl2.frag");
+    EXPECT_TRUE(directive::count(source) == 1);
+}